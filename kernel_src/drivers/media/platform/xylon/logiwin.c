@@ -15,7 +15,7 @@
  */
 
 #include <asm/io.h>
-#include <linux/delay.h>
+#include <linux/bitops.h>
 
 #include "logiwin.h"
 
@@ -79,6 +79,39 @@
 #define START_X_HALF			(SCALE_STEP >> 1)
 #define START_Y_HALF			(SCALE_STEP >> 1)
 
+static const unsigned int logiwin_shadow_roff[LOGIWIN_SHADOW_REGS] = {
+	[LOGIWIN_SHADOW_DR_X] = LOGIWIN_DR_X_ROFF,
+	[LOGIWIN_SHADOW_DR_Y] = LOGIWIN_DR_Y_ROFF,
+	[LOGIWIN_SHADOW_UL_X] = LOGIWIN_UL_X_ROFF,
+	[LOGIWIN_SHADOW_UL_Y] = LOGIWIN_UL_Y_ROFF,
+	[LOGIWIN_SHADOW_SCALE_X] = LOGIWIN_SCALE_X_ROFF,
+	[LOGIWIN_SHADOW_SCALE_Y] = LOGIWIN_SCALE_Y_ROFF,
+	[LOGIWIN_SHADOW_START_X] = LOGIWIN_START_X_ROFF,
+	[LOGIWIN_SHADOW_START_Y] = LOGIWIN_START_Y_ROFF,
+	[LOGIWIN_SHADOW_CROP_X] = LOGIWIN_CROP_X_ROFF,
+	[LOGIWIN_SHADOW_CROP_Y] = LOGIWIN_CROP_Y_ROFF,
+	[LOGIWIN_SHADOW_CONTRAST] = LOGIWIN_CONTRAST_ROFF,
+	[LOGIWIN_SHADOW_SATURATION] = LOGIWIN_SATURATION_ROFF,
+	[LOGIWIN_SHADOW_BRIGHTNESS] = LOGIWIN_BRIGHTNESS_ROFF,
+	[LOGIWIN_SHADOW_COS_HUE] = LOGIWIN_COS_HUE_ROFF,
+	[LOGIWIN_SHADOW_SIN_HUE] = LOGIWIN_SIN_HUE_ROFF
+};
+
+/* Hue cosine and sine for 0 to 30 degrees, 2048 is 1.0 */
+static const unsigned int logiwin_cos_table[31] = {
+	2048, 2047, 2046, 2045, 2043, 2040, 2036, 2032, 2028, 2022,
+	2016, 2010, 2003, 1995, 1987, 1978, 1968, 1958, 1947, 1936,
+	1924, 1911, 1898, 1885, 1870, 1856, 1840, 1824, 1808, 1791,
+	1773
+};
+
+static const unsigned int logiwin_sin_table[31] = {
+	0,   35,  71,  107, 142, 178, 214, 249, 285, 320,
+	355, 390, 425, 460, 495, 530, 564, 598, 632, 666,
+	700, 733, 767, 800, 832, 865, 897, 929, 961, 992,
+	1024
+};
+
 /* Register access functions */
 static inline unsigned long logiwin_read32(struct logiwin_parameters *lw_par,
 					   unsigned int offset)
@@ -100,6 +133,26 @@ static inline void logiwin_write32(struct logiwin_parameters *lw_par,
 		writel(val, (base + offset));
 }
 
+static inline void logiwin_shadow_set(struct logiwin_parameters *lw_par,
+				      enum logiwin_shadow_reg reg, u32 val)
+{
+	if (lw_par->shadow[reg] != val) {
+		lw_par->shadow[reg] = val;
+		lw_par->shadow_dirty |= (1 << reg);
+	}
+}
+
+static inline void logiwin_shadow_write(struct logiwin_parameters *lw_par,
+					enum logiwin_shadow_reg reg, u32 val)
+{
+	logiwin_shadow_set(lw_par, reg, val);
+
+	if (lw_par->hw_access) {
+		logiwin_write32(lw_par, logiwin_shadow_roff[reg], val);
+		lw_par->shadow_dirty &= ~(1 << reg);
+	}
+}
+
 /**
  * Enable/disable logiWIN operation
  *
@@ -107,13 +160,16 @@ static inline void logiwin_write32(struct logiwin_parameters *lw_par,
  * @op:		logiWIN operation
  * @op_flag:	logiWIN operation flag
  *
+ * Note:
+ *	Swizzle and frame store stop are switched with logiWIN disabled,
+ *	use logiwin_write_ctrl() while logiWIN is enabled.
+ *
  */
 void logiwin_operation(struct logiwin_parameters *lw_par,
 		       enum logiwin_operation op,
 		       enum logiwin_operation_flag op_flag)
 {
 	u32 op_mask;
-	unsigned int us = 0;
 
 	switch (op) {
 	case LOGIWIN_OP_ENABLE:
@@ -130,11 +186,9 @@ void logiwin_operation(struct logiwin_parameters *lw_par,
 		break;
 	case LOGIWIN_OP_FRAME_STORED_STOP:
 		op_mask = LOGIWIN_CTRL_FRAME_STORE_STOP;
-		us = 10;
 		break;
 	case LOGIWIN_OP_SWIZZLE:
 		op_mask = LOGIWIN_CTRL_SWIZZLE;
-		us = 10;
 		break;
 	}
 
@@ -143,17 +197,81 @@ void logiwin_operation(struct logiwin_parameters *lw_par,
 	else if (op_flag == LOGIWIN_OP_FLAG_DISABLE)
 		lw_par->ctrl &= ~op_mask;
 
-	if (us != 0 && (lw_par->ctrl & LOGIWIN_CTRL_ENABLE)) {
-		lw_par->ctrl &= ~LOGIWIN_CTRL_ENABLE;
-		logiwin_write32(lw_par, LOGIWIN_CTRL0_ROFF, lw_par->ctrl);
+	logiwin_write32(lw_par, LOGIWIN_CTRL0_ROFF, lw_par->ctrl);
+}
 
-		udelay(us);
+/**
+ * Write logiWIN control register
+ *
+ * @lw_par:	logiWIN data
+ * @ctrl:	control register value
+ *
+ * Returns true when logiWIN is left disabled for a mode switch.
+ *
+ * Note:
+ *	When swizzle, frame store stop or weave deinterlace bits change while
+ *	logiWIN is enabled, control register is written with logiWIN
+ *	disabled and caller calls logiwin_restart() after LOGIWIN_SWITCH_US,
+ *	without busy waiting here.
+ *
+ */
+bool logiwin_write_ctrl(struct logiwin_parameters *lw_par, u32 ctrl)
+{
+	u32 changed = lw_par->ctrl ^ ctrl;
+	bool restart = false;
 
-		lw_par->ctrl |= LOGIWIN_CTRL_ENABLE;
+	lw_par->ctrl = ctrl;
+
+	if ((changed & (LOGIWIN_CTRL_SWIZZLE | LOGIWIN_CTRL_FRAME_STORE_STOP |
+			LOGIWIN_CTRL_WEAVE_DEINTERLACE)) &&
+	    lw_par->hw_access && (ctrl & LOGIWIN_CTRL_ENABLE)) {
+		ctrl &= ~LOGIWIN_CTRL_ENABLE;
+		restart = true;
 	}
+
+	logiwin_write32(lw_par, LOGIWIN_CTRL0_ROFF, ctrl);
+
+	return restart;
+}
+
+/**
+ * Write logiWIN control register after mode switch
+ *
+ * @lw_par:	logiWIN data
+ *
+ * Note:
+ *	Writes the control register value kept in logiWIN data, which
+ *	enables logiWIN again. Caller calls it only while logiWIN is in use
+ *	and serializes it with other control register changes.
+ *
+ */
+void logiwin_restart(struct logiwin_parameters *lw_par)
+{
 	logiwin_write32(lw_par, LOGIWIN_CTRL0_ROFF, lw_par->ctrl);
 }
 
+/**
+ * Stop/resume storing frames to video memory
+ *
+ * @lw_par:	logiWIN data
+ * @stop:	stop/resume flag
+ *
+ * Returns true when logiWIN is left disabled for the mode switch, see
+ * logiwin_write_ctrl().
+ *
+ */
+bool logiwin_frame_store_stop(struct logiwin_parameters *lw_par, bool stop)
+{
+	u32 ctrl = lw_par->ctrl;
+
+	if (stop)
+		ctrl |= LOGIWIN_CTRL_FRAME_STORE_STOP;
+	else
+		ctrl &= ~LOGIWIN_CTRL_FRAME_STORE_STOP;
+
+	return logiwin_write_ctrl(lw_par, ctrl);
+}
+
 /**
  * Enable/disable logiWIN deinterlacing
  *
@@ -163,6 +281,8 @@ void logiwin_operation(struct logiwin_parameters *lw_par,
  * Note:
  *	false:	"Bob"
  *	true:	"Weave"
+ *	Switched with logiWIN disabled, use logiwin_write_ctrl() while
+ *	logiWIN is enabled.
  *
  */
 void logiwin_weave_deinterlace(struct logiwin_parameters *lw_par,
@@ -185,14 +305,6 @@ void logiwin_weave_deinterlace(struct logiwin_parameters *lw_par,
 	}
 	lw_par->weave_deinterlace = weave_deinterlace;
 
-	if (lw_par->ctrl & LOGIWIN_CTRL_ENABLE)	{
-		lw_par->ctrl &= ~LOGIWIN_CTRL_ENABLE;
-		logiwin_write32(lw_par, LOGIWIN_CTRL0_ROFF, lw_par->ctrl);
-
-		udelay(10);
-
-		lw_par->ctrl |= LOGIWIN_CTRL_ENABLE;
-	}
 	logiwin_write32(lw_par, LOGIWIN_CTRL0_ROFF, lw_par->ctrl);
 }
 
@@ -331,6 +443,34 @@ void logiwin_set_memory_offset(struct logiwin_parameters *lw_par,
 	logiwin_write32(lw_par, LOGIWIN_MEM_OFFSET_ODD_ROFF, odd_ptr);
 }
 
+/**
+ * Request logiWIN video buffer switch
+ *
+ * @lw_par:	logiWIN data
+ *
+ * Note:
+ *	With LOGIWIN_OP_CPU_VBUFF_SWITCH enabled, memory offsets written
+ *	before the request are taken by logiWIN at the next frame start.
+ *
+ */
+void logiwin_buffer_switch(struct logiwin_parameters *lw_par)
+{
+	logiwin_write32(lw_par, LOGIWIN_VBUFF_SWITCH_ROFF, 1);
+}
+
+/**
+ * Check logiWIN video buffer switch request
+ *
+ * @lw_par:	logiWIN data
+ *
+ * Returns true while requested buffer switch is not taken by logiWIN.
+ *
+ */
+bool logiwin_buffer_switch_pending(struct logiwin_parameters *lw_par)
+{
+	return logiwin_read32(lw_par, LOGIWIN_VBUFF_SWITCH_ROFF) & 1;
+}
+
 /**
  * Set logiWIN pixel alpha blending value
  *
@@ -344,6 +484,27 @@ void logiwin_set_pixel_alpha(struct logiwin_parameters *lw_par, u32 alpha)
 	logiwin_write32(lw_par, LOGIWIN_PIX_ALPHA_ROFF, alpha);
 }
 
+/* Color register values, parameters are already limited to their range */
+static inline u32 logiwin_brightness_reg(int brightness)
+{
+	return 32 + ((63 * brightness) / 100);
+}
+
+static inline u32 logiwin_gain_reg(int gain)
+{
+	return 1992 * (gain + 50) * 2048 / 100000;
+}
+
+static inline u32 logiwin_cos_hue_reg(int hue)
+{
+	return (hue < 0) ? logiwin_cos_table[-hue] : logiwin_cos_table[hue];
+}
+
+static inline u32 logiwin_sin_hue_reg(int hue)
+{
+	return (hue < 0) ? -logiwin_sin_table[-hue] : logiwin_sin_table[hue];
+}
+
 /**
  * Set output brightness
  *
@@ -362,8 +523,8 @@ void logiwin_set_brightness(struct logiwin_parameters *lw_par, int brightness)
 
 	lw_par->brightness = brightness;
 
-	regval = 32 + ((63 * brightness) / 100);
-	logiwin_write32(lw_par, LOGIWIN_BRIGHTNESS_ROFF, regval);
+	regval = logiwin_brightness_reg(brightness);
+	logiwin_shadow_write(lw_par, LOGIWIN_SHADOW_BRIGHTNESS, regval);
 }
 
 /**
@@ -384,8 +545,8 @@ void logiwin_set_contrast(struct logiwin_parameters *lw_par, int contrast)
 
 	lw_par->contrast = contrast;
 
-	regval = 1992 * (contrast + 50) * 2048 / 100000;
-	logiwin_write32(lw_par, LOGIWIN_CONTRAST_ROFF, regval);
+	regval = logiwin_gain_reg(contrast);
+	logiwin_shadow_write(lw_par, LOGIWIN_SHADOW_CONTRAST, regval);
 }
 
 /**
@@ -406,9 +567,9 @@ void logiwin_set_saturation(struct logiwin_parameters *lw_par, int saturation)
 
 	lw_par->saturation = saturation;
 
-	regval = 1992 * (saturation + 50) * 2048 / 100000;
+	regval = logiwin_gain_reg(saturation);
 
-	logiwin_write32(lw_par, LOGIWIN_SATURATION_ROFF, regval);
+	logiwin_shadow_write(lw_par, LOGIWIN_SHADOW_SATURATION, regval);
 }
 
 /**
@@ -420,18 +581,6 @@ void logiwin_set_saturation(struct logiwin_parameters *lw_par, int saturation)
  */
 void logiwin_set_hue(struct logiwin_parameters *lw_par, int hue)
 {
-	static const unsigned int cos_table[31] = {
-		2048, 2047, 2046, 2045, 2043, 2040, 2036, 2032, 2028, 2022,
-		2016, 2010, 2003, 1995, 1987, 1978, 1968, 1958, 1947, 1936,
-		1924, 1911, 1898, 1885, 1870, 1856, 1840, 1824, 1808, 1791,
-		1773
-	};
-	static const unsigned int sin_table[31] = {
-		0,   35,  71,  107, 142, 178, 214, 249, 285, 320,
-		355, 390, 425, 460, 495, 530, 564, 598, 632, 666,
-		700, 733, 767, 800, 832, 865, 897, 929, 961, 992,
-		1024
-	};
 	u32 reg_cos, reg_sin;
 
 	if (hue < -30)
@@ -441,11 +590,11 @@ void logiwin_set_hue(struct logiwin_parameters *lw_par, int hue)
 
 	lw_par->hue = hue;
 
-	reg_cos = (hue < 0) ?  cos_table[-hue] : cos_table[hue];
-	reg_sin = (hue < 0) ? -sin_table[-hue] : sin_table[hue];
+	reg_cos = logiwin_cos_hue_reg(hue);
+	reg_sin = logiwin_sin_hue_reg(hue);
 
-	logiwin_write32(lw_par, LOGIWIN_COS_HUE_ROFF, reg_cos);
-	logiwin_write32(lw_par, LOGIWIN_SIN_HUE_ROFF, reg_sin);
+	logiwin_shadow_write(lw_par, LOGIWIN_SHADOW_COS_HUE, reg_cos);
+	logiwin_shadow_write(lw_par, LOGIWIN_SHADOW_SIN_HUE, reg_sin);
 }
 
 /**
@@ -477,27 +626,115 @@ void logiwin_write_mask_stencil(struct logiwin_parameters *lw_par,
 }
 
 /**
- * Update logiWIN registers
+ * Stage logiWIN registers
  *
  * @lw_par:	logiWIN data
  *
+ * Note:
+ *	Calculates geometry, scale and color register values and marks
+ *	changed registers dirty, without writing them to hardware.
+ *
  */
-void logiwin_update_registers(struct logiwin_parameters *lw_par)
+void logiwin_stage_registers(struct logiwin_parameters *lw_par)
 {
-	logiwin_write32(lw_par, LOGIWIN_DR_X_ROFF, lw_par->output.dr_x - 1);
-	logiwin_write32(lw_par, LOGIWIN_DR_Y_ROFF, lw_par->output.dr_y - 1);
-	logiwin_write32(lw_par, LOGIWIN_UL_X_ROFF, lw_par->output.ul_x);
-	logiwin_write32(lw_par, LOGIWIN_UL_Y_ROFF, lw_par->output.ul_y);
-	logiwin_write32(lw_par, LOGIWIN_SCALE_X_ROFF,
+	logiwin_shadow_set(lw_par, LOGIWIN_SHADOW_DR_X,
+			   lw_par->output.dr_x - 1);
+	logiwin_shadow_set(lw_par, LOGIWIN_SHADOW_DR_Y,
+			   lw_par->output.dr_y - 1);
+	logiwin_shadow_set(lw_par, LOGIWIN_SHADOW_UL_X, lw_par->output.ul_x);
+	logiwin_shadow_set(lw_par, LOGIWIN_SHADOW_UL_Y, lw_par->output.ul_y);
+	logiwin_shadow_set(lw_par, LOGIWIN_SHADOW_SCALE_X,
 		(lw_par->hscale_step >> lw_par->scale_shift));
-	logiwin_write32(lw_par, LOGIWIN_SCALE_Y_ROFF,
+	logiwin_shadow_set(lw_par, LOGIWIN_SHADOW_SCALE_Y,
 		(lw_par->vscale_step >> lw_par->scale_shift));
-	logiwin_write32(lw_par, LOGIWIN_START_X_ROFF,
+	logiwin_shadow_set(lw_par, LOGIWIN_SHADOW_START_X,
 		(lw_par->start_x >> lw_par->scale_shift));
-	logiwin_write32(lw_par, LOGIWIN_START_Y_ROFF,
+	logiwin_shadow_set(lw_par, LOGIWIN_SHADOW_START_Y,
 		(lw_par->start_y >> lw_par->scale_shift));
-	logiwin_write32(lw_par, LOGIWIN_CROP_X_ROFF, lw_par->crop.left);
-	logiwin_write32(lw_par, LOGIWIN_CROP_Y_ROFF, lw_par->crop.top);
+	logiwin_shadow_set(lw_par, LOGIWIN_SHADOW_CROP_X, lw_par->crop.left);
+	logiwin_shadow_set(lw_par, LOGIWIN_SHADOW_CROP_Y, lw_par->crop.top);
+	logiwin_shadow_set(lw_par, LOGIWIN_SHADOW_CONTRAST,
+		logiwin_gain_reg(lw_par->contrast));
+	logiwin_shadow_set(lw_par, LOGIWIN_SHADOW_SATURATION,
+		logiwin_gain_reg(lw_par->saturation));
+	logiwin_shadow_set(lw_par, LOGIWIN_SHADOW_BRIGHTNESS,
+		logiwin_brightness_reg(lw_par->brightness));
+	logiwin_shadow_set(lw_par, LOGIWIN_SHADOW_COS_HUE,
+		logiwin_cos_hue_reg(lw_par->hue));
+	logiwin_shadow_set(lw_par, LOGIWIN_SHADOW_SIN_HUE,
+		logiwin_sin_hue_reg(lw_par->hue));
+}
+
+/**
+ * Commit staged logiWIN registers
+ *
+ * @lw_par:	logiWIN data
+ *
+ * Note:
+ *	Only registers which changed since the last commit are written.
+ *	Registers stay dirty while register access is disabled.
+ *
+ */
+void logiwin_commit_registers(struct logiwin_parameters *lw_par)
+{
+	void __iomem *base = lw_par->base;
+	unsigned int reg;
+
+	if (!lw_par->hw_access || !lw_par->shadow_dirty)
+		return;
+
+	/* one barrier for the whole batch instead of one per writel */
+	wmb();
+	for_each_set_bit(reg, &lw_par->shadow_dirty, LOGIWIN_SHADOW_REGS)
+		writel_relaxed(lw_par->shadow[reg],
+			       base + logiwin_shadow_roff[reg]);
+
+	lw_par->shadow_dirty = 0;
+}
+
+/**
+ * Update logiWIN registers
+ *
+ * @lw_par:	logiWIN data
+ *
+ */
+void logiwin_update_registers(struct logiwin_parameters *lw_par)
+{
+	logiwin_stage_registers(lw_par);
+	logiwin_commit_registers(lw_par);
+}
+
+/**
+ * Stage complete logiWIN register set
+ *
+ * @lw_par:	logiWIN data
+ * @shadow:	register values, LOGIWIN_SHADOW_REGS entries
+ *
+ * Note:
+ *	Register values are prepared by staging a copy of logiWIN data.
+ *	Parameters in @lw_par are not changed, only staged registers.
+ *
+ */
+void logiwin_stage_shadow(struct logiwin_parameters *lw_par, const u32 *shadow)
+{
+	unsigned int reg;
+
+	for (reg = 0; reg < LOGIWIN_SHADOW_REGS; reg++)
+		logiwin_shadow_set(lw_par, reg, shadow[reg]);
+}
+
+/**
+ * Load and commit complete logiWIN register set
+ *
+ * @lw_par:	logiWIN data
+ * @shadow:	register values, LOGIWIN_SHADOW_REGS entries
+ *
+ */
+void logiwin_load_registers(struct logiwin_parameters *lw_par,
+			    const u32 *shadow)
+{
+	logiwin_stage_shadow(lw_par, shadow);
+	logiwin_commit_registers(lw_par);
 }
 
 /**
@@ -775,7 +1012,7 @@ void logiwin_get_rect_parameters(struct logiwin_parameters *lw_par,
 				 enum logiwin_rectangle_type type)
 {
 	struct logiwin_rectangle *r;
-	int divide = 1;
+	int multiply = 1;
 
 	switch (type) {
 	case LOGIWIN_RECTANGLE_BOUNDS:
@@ -788,8 +1025,9 @@ void logiwin_get_rect_parameters(struct logiwin_parameters *lw_par,
 
 	case LOGIWIN_RECTANGLE_OUT:
 		r = &lw_par->out;
+		/* weave deinterlaced output is stored in field lines */
 		if (lw_par->weave_deinterlace)
-			divide = 2;
+			multiply = 2;
 		break;
 
 	default:
@@ -799,11 +1037,11 @@ void logiwin_get_rect_parameters(struct logiwin_parameters *lw_par,
 	if (left)
 		*left = r->left;
 	if (top)
-		*top = r->top / divide;
+		*top = r->top * multiply;
 	if (width)
 		*width = r->width;
 	if (height)
-		*height = r->height / divide;
+		*height = r->height * multiply;
 }
 
 /**
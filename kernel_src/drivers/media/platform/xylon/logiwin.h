@@ -27,6 +27,9 @@
 /* Scale step constant */
 #define SCALE_STEP		(1 << 16)
 
+/* Time logiWIN is kept disabled for mode switches */
+#define LOGIWIN_SWITCH_US	10
+
 /* Interrupt Register Bits */
 #define LOGIWIN_INT_FRAME_START	0x1
 #define LOGIWIN_INT_RESOLUTION	0x2
@@ -78,6 +81,28 @@ enum logiwin_rectangle_type {
 	LOGIWIN_RECTANGLE_OUT
 };
 
+/* logiWIN Shadowed Geometry, Scale and Color Registers */
+enum logiwin_shadow_reg {
+	LOGIWIN_SHADOW_DR_X,
+	LOGIWIN_SHADOW_DR_Y,
+	LOGIWIN_SHADOW_UL_X,
+	LOGIWIN_SHADOW_UL_Y,
+	LOGIWIN_SHADOW_SCALE_X,
+	LOGIWIN_SHADOW_SCALE_Y,
+	LOGIWIN_SHADOW_START_X,
+	LOGIWIN_SHADOW_START_Y,
+	LOGIWIN_SHADOW_CROP_X,
+	LOGIWIN_SHADOW_CROP_Y,
+	LOGIWIN_SHADOW_CONTRAST,
+	LOGIWIN_SHADOW_SATURATION,
+	LOGIWIN_SHADOW_BRIGHTNESS,
+	LOGIWIN_SHADOW_COS_HUE,
+	LOGIWIN_SHADOW_SIN_HUE,
+	LOGIWIN_SHADOW_REGS
+};
+
+#define LOGIWIN_SHADOW_ALL	((1 << LOGIWIN_SHADOW_REGS) - 1)
+
 /*
  * logiWIN rectangle
  * @x:	upper left x
@@ -113,6 +138,8 @@ struct logiwin_output {
  * @bounds:			Input bounds rectangle
  * @crop:			Input crop rectangle
  * @ctrl:			Control register
+ * @shadow:			Geometry, scale and color register values
+ * @shadow_dirty:		Shadow registers not yet written to hardware
  * @int_mask:			Interrupt mask value
  * @out_align_mask:		Output byte alignment mask
  * @out:			Output rectangle
@@ -150,6 +177,8 @@ struct logiwin_parameters {
 	struct logiwin_rectangle out;
 	struct logiwin_output output;
 	u32 ctrl;
+	u32 shadow[LOGIWIN_SHADOW_REGS];
+	unsigned long shadow_dirty;
 	u32 int_mask;
 	u32 out_align_mask;
 	unsigned int out_hres;
@@ -175,6 +204,9 @@ struct logiwin_parameters {
 void logiwin_operation(struct logiwin_parameters *lw_par,
 		       enum logiwin_operation op,
 		       enum logiwin_operation_flag op_flag);
+bool logiwin_write_ctrl(struct logiwin_parameters *lw_par, u32 ctrl);
+void logiwin_restart(struct logiwin_parameters *lw_par);
+bool logiwin_frame_store_stop(struct logiwin_parameters *lw_par, bool stop);
 void logiwin_weave_deinterlace(struct logiwin_parameters *lw,
 			       bool weave_deinterlace);
 void logiwin_select_input_ch(struct logiwin_parameters *lw, unsigned int ch);
@@ -188,6 +220,8 @@ void logiwin_get_resolution(struct logiwin_parameters *lw,
 
 void logiwin_set_memory_offset(struct logiwin_parameters *lw,
 			       u32 even_ptr, u32 odd_ptr);
+void logiwin_buffer_switch(struct logiwin_parameters *lw_par);
+bool logiwin_buffer_switch_pending(struct logiwin_parameters *lw_par);
 void logiwin_set_pixel_alpha(struct logiwin_parameters *lw, u32 alpha);
 
 void logiwin_set_brightness(struct logiwin_parameters *lw, int brightness);
@@ -199,7 +233,12 @@ void logiwin_write_mask_stencil(struct logiwin_parameters *lw,
 				unsigned int *mask_buffer,
 				unsigned int offset, unsigned int length);
 
+void logiwin_stage_registers(struct logiwin_parameters *lw);
+void logiwin_commit_registers(struct logiwin_parameters *lw);
 void logiwin_update_registers(struct logiwin_parameters *lw);
+void logiwin_stage_shadow(struct logiwin_parameters *lw, const u32 *shadow);
+void logiwin_load_registers(struct logiwin_parameters *lw,
+			    const u32 *shadow);
 
 /* Interrupt functions */
 void logiwin_int(struct logiwin_parameters *lw, u32 mask, bool enable);
@@ -0,0 +1,133 @@
+/*
+ * Xylon logiWIN frame grabber tracepoints
+ *
+ * Copyright (C) 2014 Xylon d.o.o.
+ * Author: Davor Joja <davor.joja@logicbricks.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM logiwin
+
+#if !defined(__LOGIWIN_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __LOGIWIN_TRACE_H__
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(logiwin_isr,
+	TP_PROTO(int minor, u32 status, u32 sequence, u64 ts),
+	TP_ARGS(minor, status, sequence, ts),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(u32, status)
+		__field(u32, sequence)
+		__field(u64, ts)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->status = status;
+		__entry->sequence = sequence;
+		__entry->ts = ts;
+	),
+	TP_printk("minor = %d, status = 0x%08x, sequence = %u, ts = %llu",
+		  __entry->minor, __entry->status, __entry->sequence,
+		  __entry->ts)
+);
+
+DECLARE_EVENT_CLASS(logiwin_buf_class,
+	TP_PROTO(int minor, u32 index, u32 sequence, u64 ts),
+	TP_ARGS(minor, index, sequence, ts),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(u32, index)
+		__field(u32, sequence)
+		__field(u64, ts)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->index = index;
+		__entry->sequence = sequence;
+		__entry->ts = ts;
+	),
+	TP_printk("minor = %d, index = %u, sequence = %u, ts = %llu",
+		  __entry->minor, __entry->index, __entry->sequence,
+		  __entry->ts)
+);
+
+DEFINE_EVENT(logiwin_buf_class, logiwin_get_buf,
+	TP_PROTO(int minor, u32 index, u32 sequence, u64 ts),
+	TP_ARGS(minor, index, sequence, ts)
+);
+
+DEFINE_EVENT(logiwin_buf_class, logiwin_buf_done,
+	TP_PROTO(int minor, u32 index, u32 sequence, u64 ts),
+	TP_ARGS(minor, index, sequence, ts)
+);
+
+DEFINE_EVENT(logiwin_buf_class, logiwin_qbuf,
+	TP_PROTO(int minor, u32 index, u32 sequence, u64 ts),
+	TP_ARGS(minor, index, sequence, ts)
+);
+
+DEFINE_EVENT(logiwin_buf_class, logiwin_dqbuf,
+	TP_PROTO(int minor, u32 index, u32 sequence, u64 ts),
+	TP_ARGS(minor, index, sequence, ts)
+);
+
+TRACE_EVENT(logiwin_update_registers,
+	TP_PROTO(int minor, u32 flags, u32 sequence, u64 ts),
+	TP_ARGS(minor, flags, sequence, ts),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(u32, flags)
+		__field(u32, sequence)
+		__field(u64, ts)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->flags = flags;
+		__entry->sequence = sequence;
+		__entry->ts = ts;
+	),
+	TP_printk("minor = %d, flags = 0x%08x, sequence = %u, ts = %llu",
+		  __entry->minor, __entry->flags, __entry->sequence,
+		  __entry->ts)
+);
+
+TRACE_EVENT(logiwin_resolution,
+	TP_PROTO(int minor, u32 width, u32 height, u32 sequence, u64 ts),
+	TP_ARGS(minor, width, height, sequence, ts),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(u32, width)
+		__field(u32, height)
+		__field(u32, sequence)
+		__field(u64, ts)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->width = width;
+		__entry->height = height;
+		__entry->sequence = sequence;
+		__entry->ts = ts;
+	),
+	TP_printk("minor = %d, %ux%u, sequence = %u, ts = %llu",
+		  __entry->minor, __entry->width, __entry->height,
+		  __entry->sequence, __entry->ts)
+);
+
+#endif /* __LOGIWIN_TRACE_H__ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE logiwin_trace
+#include <trace/define_trace.h>
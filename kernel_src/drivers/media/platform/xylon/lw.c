@@ -14,21 +14,34 @@
  * GNU General Public License for more details.
  */
 
+#include <linux/debugfs.h>
 #include <linux/delay.h>
+#include <linux/dma-contiguous.h>
 #include <linux/dma-mapping.h>
 #include <linux/interrupt.h>
 #include <linux/io.h>
-#include <linux/list.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/of.h>
 #include <linux/platform_device.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
 
 #include <media/v4l2-common.h>
+#include <media/v4l2-ctrls.h>
 #include <media/v4l2-device.h>
+#include <media/v4l2-event.h>
+#include <media/v4l2-fh.h>
 #include <media/v4l2-ioctl.h>
+#include <media/videobuf2-core.h>
+#include <media/videobuf2-dma-contig.h>
+#include <media/videobuf2-memops.h>
 
 #include "logiwin.h"
 
+#define CREATE_TRACE_POINTS
+#include "logiwin_trace.h"
+
 #define INFO		1
 #define CORE		2
 #define DEBUG_LEVEL	CORE
@@ -50,18 +63,21 @@
 #define LOGIWIN_DRIVER_VERSION		"1.0"
 
 #define LOGIWIN_DMA_BUFFERS		3
+#define LOGIWIN_MIN_BUFFERS		2
+#define LOGIWIN_MAX_BUFFERS		VIDEO_MAX_FRAME
+#define LOGIWIN_RING_MASK		(LOGIWIN_MAX_BUFFERS - 1)
 #define LOGIWIN_KERNEL_VERSION		3
 
-#define LOGIWIN_FLAG_UPDATE_REGISTERS		(1 << 0)
-#define LOGIWIN_FLAG_BUFFERS_AVAILABLE		(1 << 1)
-#define LOGIWIN_FLAG_BUFFERS_REALLOCATE		(1 << 2)
-#define LOGIWIN_FLAG_BUFFERS_DESTROY		(1 << 3)
-#define LOGIWIN_FLAG_DEINTERLACE		(1 << 4)
-#define LOGIWIN_FLAG_RESOLUTION_CHANGE		(1 << 5)
-#define LOGIWIN_FLAG_RESOLUTION			(1 << 6)
-#define LOGIWIN_FLAG_DEVICE_IN_USE		(1 << 7)
-#define LOGIWIN_FLAG_OVERLAY_BUFFER_SWITCH	(1 << 8)
-#define LOGIWIN_FLAG_HW_BUFFER_SWITCH		(1 << 9)
+/* lw->flags bit numbers, changed with atomic bitops from any context */
+#define LOGIWIN_FLAG_UPDATE_REGISTERS		0
+#define LOGIWIN_FLAG_ANIM_STEP			1
+#define LOGIWIN_FLAG_CTRL_RESTART		2
+#define LOGIWIN_FLAG_DEINTERLACE		4
+#define LOGIWIN_FLAG_RESOLUTION_CHANGE		5
+#define LOGIWIN_FLAG_RESOLUTION			6
+#define LOGIWIN_FLAG_OVERLAY_BUFFER_SWITCH	8
+#define LOGIWIN_FLAG_HW_BUFFER_SWITCH		9
+#define LOGIWIN_FLAG_CPU_BUFFER_SWITCH		10
 
 #define LOGIWIN_IOCTL_FRAME_INT		_IO('V', BASE_VIDIOC_PRIVATE)
 #define LOGIWIN_IOCTL_RESOLUTION_INT	_IO('V', (BASE_VIDIOC_PRIVATE + 1))
@@ -79,6 +95,91 @@
 	_IOR('V', (BASE_VIDIOC_PRIVATE + 7), unsigned int)
 #define LOGIWIN_IOCTL_FRAME_PHYS_ADDRESS	\
 	_IOR('V', (BASE_VIDIOC_PRIVATE + 8), unsigned long)
+#define LOGIWIN_IOCTL_BUFFER_SYNC	\
+	_IOW('V', (BASE_VIDIOC_PRIVATE + 9), struct logiwin_buffer_sync)
+#define LOGIWIN_IOCTL_BUFFER_CONFIG	\
+	_IOW('V', (BASE_VIDIOC_PRIVATE + 10), struct logiwin_buffer_config)
+#define LOGIWIN_IOCTL_ROI		\
+	_IOW('V', (BASE_VIDIOC_PRIVATE + 11), struct logiwin_roi_list)
+
+#define LOGIWIN_IOCTL_ANIMATION		\
+	_IOW('V', (BASE_VIDIOC_PRIVATE + 12), struct logiwin_animation)
+
+#define LOGIWIN_IOCTL_CONFIG		\
+	_IOW('V', (BASE_VIDIOC_PRIVATE + 13), struct logiwin_params)
+
+#define LOGIWIN_MAX_ROI			8
+#define LOGIWIN_MAX_PARAMS		8
+
+#define LOGIWIN_PARAM_CROP		1
+#define LOGIWIN_PARAM_WINDOW		2
+#define LOGIWIN_PARAM_ALPHA		3
+#define LOGIWIN_PARAM_SYNC_POLARITY	4
+#define LOGIWIN_PARAM_SWIZZLE		5
+#define LOGIWIN_MAX_KEYFRAMES		16
+#define LOGIWIN_MAX_KEYFRAME_FRAMES	0xFFFF
+
+#define LOGIWIN_ANIMATION_CROP		(1 << 0)
+#define LOGIWIN_ANIMATION_WINDOW	(1 << 1)
+#define LOGIWIN_ANIMATION_ALPHA		(1 << 2)
+#define LOGIWIN_ANIMATION_LOOP		(1 << 3)
+#define LOGIWIN_ANIMATION_ALL		(LOGIWIN_ANIMATION_CROP | \
+					 LOGIWIN_ANIMATION_WINDOW | \
+					 LOGIWIN_ANIMATION_ALPHA | \
+					 LOGIWIN_ANIMATION_LOOP)
+
+#define LOGIWIN_BUFFER_CONFIG_CROP	(1 << 0)
+#define LOGIWIN_BUFFER_CONFIG_OUT	(1 << 1)
+#define LOGIWIN_BUFFER_CONFIG_COLOR	(1 << 2)
+#define LOGIWIN_BUFFER_CONFIG_ALL	(LOGIWIN_BUFFER_CONFIG_CROP | \
+					 LOGIWIN_BUFFER_CONFIG_OUT | \
+					 LOGIWIN_BUFFER_CONFIG_COLOR)
+
+/*
+ * The base for the logiWIN driver controls. The driver is not in
+ * include/uapi/linux/v4l2-controls.h, the range is kept well above the
+ * driver ranges reserved there (0x1070 belongs to adv7180). We reserve
+ * 16 controls for this driver.
+ */
+#ifndef V4L2_CID_USER_LOGIWIN_BASE
+#define V4L2_CID_USER_LOGIWIN_BASE	(V4L2_CID_USER_BASE + 0x1f00)
+#endif
+#define LOGIWIN_CID_BASE		V4L2_CID_USER_LOGIWIN_BASE
+#define LOGIWIN_CID_FRAMES_CAPTURED	(LOGIWIN_CID_BASE + 0)
+#define LOGIWIN_CID_FRAMES_SKIPPED	(LOGIWIN_CID_BASE + 1)
+#define LOGIWIN_CID_RESOLUTION_CHANGES	(LOGIWIN_CID_BASE + 2)
+#define LOGIWIN_CID_OVERLAY_SWITCHES	(LOGIWIN_CID_BASE + 3)
+#define LOGIWIN_CID_FRAMES_LATE		(LOGIWIN_CID_BASE + 4)
+#define LOGIWIN_CID_IRQ_LATENCY		(LOGIWIN_CID_BASE + 5)
+#define LOGIWIN_CID_DQBUF_LATENCY	(LOGIWIN_CID_BASE + 6)
+#define LOGIWIN_CID_FRAME_INTERVAL	(LOGIWIN_CID_BASE + 7)
+
+#define LOGIWIN_HIST_BUCKETS		32
+
+#define LOGIWIN_EVENT_COMMIT		(V4L2_EVENT_PRIVATE_START + 1)
+
+/*
+ * LOGIWIN_EVENT_COMMIT data
+ * @sequence:	sequence number of the first frame captured with committed
+ *		settings
+ */
+struct logiwin_event_commit {
+	__u32 sequence;
+};
+
+#define LOGIWIN_EVENT_ROI		(V4L2_EVENT_PRIVATE_START + 2)
+
+/*
+ * LOGIWIN_EVENT_ROI data
+ * @index:	index of the captured buffer
+ * @sequence:	sequence number of the captured buffer
+ * @roi:	region of interest captured to the buffer
+ */
+struct logiwin_event_roi {
+	__u32 index;
+	__u32 sequence;
+	__u32 roi;
+};
 
 enum logiwin_stream_state {
 	STREAM_OFF,
@@ -86,19 +187,142 @@ enum logiwin_stream_state {
 	OVERLAY_STREAM_ON
 };
 
-enum logiwin_frame_state {
-	FRAME_UNUSED,
-	FRAME_QUEUED,
-	FRAME_DEQUEUED,
-	FRAME_DONE
+enum logiwin_cache_mode {
+	LOGIWIN_CACHE_WRITE_COMBINE,
+	LOGIWIN_CACHE_CACHED
 };
 
+static unsigned int cache_mode = LOGIWIN_CACHE_WRITE_COMBINE;
+module_param(cache_mode, uint, S_IRUGO);
+MODULE_PARM_DESC(cache_mode, "Capture buffer mapping "
+		 "(0 - write-combined, 1 - cached)");
+
+static unsigned int irq_priority = MAX_USER_RT_PRIO / 2;
+module_param(irq_priority, uint, S_IRUGO);
+MODULE_PARM_DESC(irq_priority, "SCHED_FIFO priority of the interrupt thread "
+		 "(1 - 98)");
+
 struct logiwin_frame {
-	struct list_head frame;
-	struct v4l2_buffer buf;
-	enum logiwin_frame_state state;
-	u32 buff_addr;
-	atomic_t vma_refcnt;
+	struct vb2_buffer vb;
+	u64 ts;
+	bool config;
+	u32 shadow[LOGIWIN_SHADOW_REGS];
+	/* region of interest captured to the buffer, -1 when not used */
+	int roi;
+};
+
+struct logiwin_mem_buf {
+	struct device *dev;
+	struct page *pages;
+	dma_addr_t dma_addr;
+	unsigned long size;
+	atomic_t refcount;
+	struct vb2_vmarea_handler handler;
+};
+
+/*
+ * logiWIN buffer sync
+ * @index:	dequeued buffer index
+ * @rect:	buffer area to be made visible to the CPU, in pixels and lines
+ */
+struct logiwin_buffer_sync {
+	__u32 index;
+	struct v4l2_rect rect;
+};
+
+/*
+ * logiWIN buffer config
+ * @index:	dequeued buffer index
+ * @flags:	LOGIWIN_BUFFER_CONFIG_* settings to apply, 0 clears settings
+ * @crop:	input crop rectangle
+ * @width:	output width, not larger than format width
+ * @height:	output height, not larger than format height
+ * @brightness:	output brightness in range (-50,50)
+ * @contrast:	output contrast in range (-50,50)
+ * @saturation:	output saturation in range (-50,50)
+ * @hue:	output hue in range (-30,30)
+ */
+struct logiwin_buffer_config {
+	__u32 index;
+	__u32 flags;
+	struct v4l2_rect crop;
+	__u32 width;
+	__u32 height;
+	__s32 brightness;
+	__s32 contrast;
+	__s32 saturation;
+	__s32 hue;
+};
+
+/*
+ * logiWIN region of interest
+ * @crop:	input crop rectangle
+ * @out:	output rectangle in the capture buffer
+ */
+struct logiwin_roi {
+	struct v4l2_rect crop;
+	struct v4l2_rect out;
+};
+
+/*
+ * logiWIN regions of interest list
+ * @count:	number of regions, 0 disables round-robin capture
+ * @roi:	regions captured to consecutive buffers in round-robin order
+ */
+struct logiwin_roi_list {
+	__u32 count;
+	struct logiwin_roi roi[LOGIWIN_MAX_ROI];
+};
+
+/*
+ * logiWIN animation keyframe
+ * @crop:	input crop rectangle
+ * @window:	output window rectangle
+ * @alpha:	overlay alpha (0 - 255)
+ * @frames:	number of frames to reach the next keyframe (1 - 65535)
+ */
+struct logiwin_keyframe {
+	struct v4l2_rect crop;
+	struct v4l2_rect window;
+	__u32 alpha;
+	__u32 frames;
+};
+
+/*
+ * logiWIN animation
+ * @count:	number of keyframes, 0 stops animation
+ * @flags:	LOGIWIN_ANIMATION_* animated parameters and loop flag
+ * @key:	keyframes
+ */
+struct logiwin_animation {
+	__u32 count;
+	__u32 flags;
+	struct logiwin_keyframe key[LOGIWIN_MAX_KEYFRAMES];
+};
+
+/*
+ * logiWIN parameter update
+ * @type:	LOGIWIN_PARAM_* parameter type
+ * @u.rect:	crop rectangle or output window
+ * @u.value:	alpha, V4L2_DV_*SYNC_POS_POL sync polarity or swizzle enable
+ */
+struct logiwin_param {
+	__u32 type;
+	union {
+		struct v4l2_rect rect;
+		__u32 value;
+	} u;
+};
+
+/*
+ * logiWIN parameter updates, validated together and committed at
+ * the same frame start
+ * @count:	number of parameters
+ * @param:	parameter updates
+ */
+struct logiwin_params {
+	__u32 count;
+	struct logiwin_param param[LOGIWIN_MAX_PARAMS];
 };
 
 struct logiwin_video_norm {
@@ -110,7 +334,6 @@ struct logiwin_video_norm {
 
 struct logiwin_dma {
 	dma_addr_t pa;
-	void *va;
 };
 
 struct logiwin_buffer {
@@ -132,6 +355,19 @@ struct logiwin_config {
 	u32 out_align;
 	u32 scale_fraction_bits;
 	bool hw_buff_switch;
+	bool cpu_buff_switch;
+};
+
+struct logiwin_stats {
+	u32 frames_captured;
+	u32 frames_skipped;
+	u32 resolution_changes;
+	u32 overlay_switches;
+	u32 frames_late;
+	/* log2 histograms, bucket n counts intervals of 2^n to 2^(n+1) ns */
+	u32 irq_latency[LOGIWIN_HIST_BUCKETS];
+	u32 dqbuf_latency[LOGIWIN_HIST_BUCKETS];
+	u32 frame_interval[LOGIWIN_HIST_BUCKETS];
 };
 
 struct logiwin_hw {
@@ -139,9 +375,6 @@ struct logiwin_hw {
 	dma_addr_t vmem_pbase;
 
 	void __iomem *reg_base;
-#ifdef LOGIWIN_MMAP_VMEM
-	void __iomem *vmem_base;
-#endif
 	unsigned long vmem_size;
 
 	unsigned int bpp;
@@ -155,17 +388,54 @@ struct logiwin {
 	struct logiwin_hw lw_hw;
 	struct logiwin_parameters lw_par;
 
-	struct logiwin_buffer capture;
 	struct logiwin_buffer overlay;
 
-	struct logiwin_frame *frame;
-	unsigned int frames;
-	unsigned int frames_queue;
+	struct vb2_queue queue;
+	void *alloc_ctx;
+	enum logiwin_cache_mode cache_mode;
+
+	struct logiwin_frame *active;
+	/* buffer requested with cpu-buffer-switch, not yet taken by logiWIN */
+	struct logiwin_frame *armed;
+	/* frame_seq at which a late written armed buffer becomes active */
+	unsigned int armed_seq;
+	/* frame_seq completing the frame cut by a mode switch restart */
+	unsigned int torn_seq;
 	unsigned int frames_skip;
 	unsigned int frame_seq;
-
-	struct list_head inqueue;
-	struct list_head outqueue;
+	u64 frame_ts;
+	/* average field period and missed field starts, field alternate */
+	u64 field_period;
+	unsigned int fields_missed;
+
+	bool commit_pending;
+
+	u32 roi_shadow[LOGIWIN_MAX_ROI][LOGIWIN_SHADOW_REGS];
+	unsigned int roi_count;
+	unsigned int roi_next;
+
+	struct logiwin_animation anim;
+	unsigned int anim_key;
+	unsigned int anim_frame;
+	bool anim_active;
+	bool alpha_pending;
+	u8 alpha;
+	u32 ctrl_set;
+	u32 ctrl_clear;
+
+	struct logiwin_stats stats;
+	struct v4l2_ctrl_handler ctrl_handler;
+	struct dentry *debugfs;
+
+	/*
+	 * Queued buffers ring, filled by buf_queue with queue_lock held and
+	 * emptied by the interrupt handler, or by the driver while the
+	 * interrupt is disabled. Holds at most LOGIWIN_MAX_BUFFERS entries,
+	 * indexes run freely and are masked on access.
+	 */
+	struct logiwin_frame *ring[LOGIWIN_MAX_BUFFERS];
+	unsigned int ring_head;
+	unsigned int ring_tail;
 
 	struct video_device video_dev;
 	struct v4l2_device v4l2_dev;
@@ -179,13 +449,13 @@ struct logiwin {
 
 	struct mutex fops_lock;
 	struct mutex ioctl_lock;
+	struct mutex queue_lock;
 
 	spinlock_t irq_lock;
 
-	struct tasklet_struct tasklet;
+	bool irq_thread_rt;
 
 	wait_queue_head_t wait_buff_switch;
-	wait_queue_head_t wait_frame;
 	wait_queue_head_t wait_resolution;
 
 	atomic_t wait_buff_switch_refcnt;
@@ -193,9 +463,14 @@ struct logiwin {
 
 	enum logiwin_stream_state stream_state;
 
-	u32 flags;
+	unsigned long flags;
 };
 
+static inline struct logiwin_frame *to_logiwin_frame(struct vb2_buffer *vb)
+{
+	return container_of(vb, struct logiwin_frame, vb);
+}
+
 static const char logiwin_formats[][22] = {
 	{"5:6:5, packed, RGB"},
 	{"8:8:8:8, packed, ARGB"},
@@ -213,79 +488,363 @@ static void logiwin_set_video_norm(struct logiwin_video_norm *video_norm,
 	video_norm->height = height;
 }
 
+/* Called with irq_lock held */
+static void logiwin_commit(struct logiwin *lw)
+{
+	struct logiwin_event_commit *commit;
+	struct v4l2_event ev;
+	bool restart = false;
+
+	trace_logiwin_update_registers(lw->video_dev.minor, lw->flags,
+				       lw->frame_seq, lw->frame_ts);
+	logiwin_commit_registers(&lw->lw_par);
+	lw->commit_pending = false;
+
+	if (lw->alpha_pending) {
+		logiwin_set_pixel_alpha(&lw->lw_par, lw->alpha);
+		lw->alpha_pending = false;
+	}
+
+	if (lw->ctrl_set || lw->ctrl_clear) {
+		if (logiwin_write_ctrl(&lw->lw_par,
+				       (lw->lw_par.ctrl & ~lw->ctrl_clear) |
+				       lw->ctrl_set))
+			restart = true;
+		lw->ctrl_set = 0;
+		lw->ctrl_clear = 0;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = LOGIWIN_EVENT_COMMIT;
+	commit = (struct logiwin_event_commit *)ev.u.data;
+	/*
+	 * logiWIN disabled for a mode switch stops in the frame starting
+	 * now, the first complete frame in new mode is the following one.
+	 */
+	if (lw->stream_state == STREAM_OFF)
+		commit->sequence = 0;
+	else
+		commit->sequence = lw->frame_seq + (restart ? 1 : 0);
+	v4l2_event_queue(&lw->video_dev, &ev);
+
+	if (restart) {
+		lw->torn_seq = lw->frame_seq + 1;
+		set_bit(LOGIWIN_FLAG_CTRL_RESTART, &lw->flags);
+	}
+}
+
+/*
+ * Stage geometry and scale registers. Staged registers are committed as
+ * a unit at the next frame start, or immediately when the frame start
+ * interrupt is not used.
+ */
+static void logiwin_stage(struct logiwin *lw)
+{
+	logiwin_stage_registers(&lw->lw_par);
+
+	if (lw->stream_state != STREAM_OFF &&
+	    !test_bit(LOGIWIN_FLAG_HW_BUFFER_SWITCH, &lw->flags))
+		lw->commit_pending = true;
+	else
+		logiwin_commit(lw);
+}
+
+static void logiwin_stage_update(struct logiwin *lw)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lw->irq_lock, flags);
+	logiwin_stage(lw);
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
+}
+
+/*
+ * Reenable logiWIN left disabled by a control register mode switch.
+ * Called from process context or the interrupt thread, sleeps instead of
+ * busy waiting in the interrupt handler or with ioctl lock held.
+ */
+static void logiwin_ctrl_restart(struct logiwin *lw)
+{
+	unsigned long flags;
+
+	if (!test_bit(LOGIWIN_FLAG_CTRL_RESTART, &lw->flags))
+		return;
+
+	usleep_range(LOGIWIN_SWITCH_US, 2 * LOGIWIN_SWITCH_US);
+
+	spin_lock_irqsave(&lw->irq_lock, flags);
+	if (test_and_clear_bit(LOGIWIN_FLAG_CTRL_RESTART, &lw->flags) &&
+	    (lw->stream_state != STREAM_OFF))
+		logiwin_restart(&lw->lw_par);
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
+}
+
+/*
+ * Take over crop, output and scale parameters prepared on a copy of
+ * logiWIN data. Called with irq_lock held, followed by logiwin_stage().
+ * logiWIN data is changed only with ioctl_lock held, so the copy is not
+ * overwritten meanwhile by another ioctl or the interrupt thread.
+ */
+static void logiwin_copy_geometry(struct logiwin *lw,
+				  const struct logiwin_parameters *lw_par)
+{
+	lw->lw_par.crop = lw_par->crop;
+	lw->lw_par.out = lw_par->out;
+	lw->lw_par.output = lw_par->output;
+	lw->lw_par.hscale_step = lw_par->hscale_step;
+	lw->lw_par.vscale_step = lw_par->vscale_step;
+	lw->lw_par.start_x = lw_par->start_x;
+	lw->lw_par.start_y = lw_par->start_y;
+	lw->lw_par.weave_deinterlace = lw_par->weave_deinterlace;
+}
+
+/*
+ * ioctl lock for the interrupt thread. The SCHED_FIFO thread does not wait
+ * for a lower priority holder, the caller retries at the next frame start.
+ * Without frame start interrupt there is no next frame to retry at and the
+ * thread waits.
+ */
+static bool logiwin_thread_lock(struct logiwin *lw)
+{
+	if (test_bit(LOGIWIN_FLAG_HW_BUFFER_SWITCH, &lw->flags)) {
+		mutex_lock(&lw->ioctl_lock);
+		return true;
+	}
+
+	return mutex_trylock(&lw->ioctl_lock);
+}
+
+/*
+ * Reset crop to the new input resolution. Registers are staged and
+ * committed at the next frame start like other geometry changes.
+ * Returns -EBUSY when ioctl lock is held, the update is then retried.
+ */
 static int logiwin_update(struct logiwin *lw)
 {
+	struct logiwin_parameters lw_par;
+	struct v4l2_event ev;
+	unsigned long flags;
 	u32 h, v;
 
 	LW_DBG(INFO, "");
 
-	if (lw->flags & LOGIWIN_FLAG_RESOLUTION_CHANGE) {
-		logiwin_get_resolution(&lw->lw_par, &h, &v);
-		if ((h > 0) && (h <= MAX_IN_HRES) &&
-		    (v > 0) && (v <= MAX_IN_VRES)) {
-			lw->lw_par.bounds.left = 0;
-			lw->lw_par.bounds.top = 0;
-			lw->lw_par.bounds.width = h;
-			lw->lw_par.bounds.height = v;
+	if (!test_bit(LOGIWIN_FLAG_RESOLUTION_CHANGE, &lw->flags))
+		return 0;
 
-			lw->lw_par.crop = lw->lw_par.bounds;
+	if (!logiwin_thread_lock(lw))
+		return -EBUSY;
 
-			logiwin_set_scale(&lw->lw_par);
+	/* resolution is read after the flag, a later change sets it again */
+	clear_bit(LOGIWIN_FLAG_RESOLUTION_CHANGE, &lw->flags);
 
-			lw->flags |= LOGIWIN_FLAG_RESOLUTION;
-			wake_up_interruptible(&lw->wait_resolution);
+	logiwin_get_resolution(&lw->lw_par, &h, &v);
+	if ((h > 0) && (h <= MAX_IN_HRES) &&
+	    (v > 0) && (v <= MAX_IN_VRES)) {
+		spin_lock_irqsave(&lw->irq_lock, flags);
+		lw_par = lw->lw_par;
+		spin_unlock_irqrestore(&lw->irq_lock, flags);
+		lw_par.hw_access = false;
 
-			lw->lw_cfg.input_hres = h;
-			lw->lw_cfg.input_vres = v;
-		}
+		lw_par.bounds.left = 0;
+		lw_par.bounds.top = 0;
+		lw_par.bounds.width = h;
+		lw_par.bounds.height = v;
+
+		lw_par.crop = lw_par.bounds;
+
+		logiwin_set_scale(&lw_par);
 
-		lw->flags &= ~LOGIWIN_FLAG_RESOLUTION_CHANGE;
+		spin_lock_irqsave(&lw->irq_lock, flags);
+		lw->lw_par.bounds = lw_par.bounds;
+		logiwin_copy_geometry(lw, &lw_par);
+		logiwin_stage(lw);
+		spin_unlock_irqrestore(&lw->irq_lock, flags);
+
+		set_bit(LOGIWIN_FLAG_RESOLUTION, &lw->flags);
+		wake_up_interruptible(&lw->wait_resolution);
+
+		memset(&ev, 0, sizeof(ev));
+		ev.type = V4L2_EVENT_SOURCE_CHANGE;
+		ev.u.src_change.changes = V4L2_EVENT_SRC_CH_RESOLUTION;
+		v4l2_event_queue(&lw->video_dev, &ev);
+
+		lw->lw_cfg.input_hres = h;
+		lw->lw_cfg.input_vres = v;
+
+		trace_logiwin_resolution(lw->video_dev.minor, h, v,
+					 lw->frame_seq, lw->frame_ts);
 	}
 
-	logiwin_update_registers(&lw->lw_par);
+	mutex_unlock(&lw->ioctl_lock);
 
 	return 0;
 }
 
-static unsigned int logiwin_get_buf(struct logiwin *lw)
+/*
+ * Switch between "bob" and weave deinterlacing. Output geometry and
+ * control register are staged together, so the switch takes effect at
+ * frame start.
+ */
+static void logiwin_set_weave(struct logiwin *lw, bool weave)
 {
+	struct logiwin_parameters lw_par;
 	unsigned long flags;
-	unsigned int curr_id;
-	int queued;
+	u32 ctrl, set, clear;
 
-	if (lw->stream_state == CAPTURE_STREAM_ON) {
-		curr_id = lw->capture.id;
+	LW_DBG(INFO, "");
 
-		spin_lock_irqsave(&lw->irq_lock, flags);
-		queued = lw->frames_queue;
-		spin_unlock_irqrestore(&lw->irq_lock, flags);
+	if (lw->lw_par.weave_deinterlace == weave)
+		return;
+
+	spin_lock_irqsave(&lw->irq_lock, flags);
+	lw_par = lw->lw_par;
+	ctrl = lw_par.ctrl;
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
 
-		if (queued == 0)
-			return curr_id;
+	lw_par.hw_access = false;
+	logiwin_weave_deinterlace(&lw_par, weave);
 
-		do {
-			if (lw->capture.id < (lw->frames - 1))
-				lw->capture.id++;
-			else
-				lw->capture.id = 0;
+	set = lw_par.ctrl & ~ctrl;
+	clear = ctrl & ~lw_par.ctrl;
 
-			if (lw->frame[lw->capture.id].state == FRAME_QUEUED)
-				break;
+	spin_lock_irqsave(&lw->irq_lock, flags);
 
-			queued--;
-		} while (queued > 0);
+	lw->lw_par.out = lw_par.out;
+	lw->lw_par.vscale_step = lw_par.vscale_step;
+	lw->lw_par.weave_deinterlace = lw_par.weave_deinterlace;
+	lw->ctrl_set = (lw->ctrl_set & ~clear) | set;
+	lw->ctrl_clear = (lw->ctrl_clear & ~set) | clear;
+	logiwin_stage(lw);
 
-		return queued ? lw->capture.id : curr_id;
-	} else if (lw->stream_state == OVERLAY_STREAM_ON) {
-		if (lw->overlay.id < (lw->frames - 1))
-			lw->overlay.id++;
-		else
-			lw->overlay.id = 0;
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
 
-		return lw->overlay.id;
-	} else {
-		return 0;
+	logiwin_ctrl_restart(lw);
+}
+
+/*
+ * Stage logiWIN operation enable/disable, written at frame start with
+ * other staged settings.
+ */
+static void logiwin_stage_operation(struct logiwin *lw,
+				    enum logiwin_operation op, bool enable)
+{
+	struct logiwin_parameters lw_par;
+	unsigned long flags;
+	u32 ctrl, set, clear;
+
+	LW_DBG(INFO, "");
+
+	spin_lock_irqsave(&lw->irq_lock, flags);
+
+	lw_par = lw->lw_par;
+	ctrl = lw_par.ctrl;
+	lw_par.hw_access = false;
+	logiwin_operation(&lw_par, op, enable ? LOGIWIN_OP_FLAG_ENABLE :
+						LOGIWIN_OP_FLAG_DISABLE);
+
+	set = lw_par.ctrl & ~ctrl;
+	clear = ctrl & ~lw_par.ctrl;
+	lw->ctrl_set = (lw->ctrl_set & ~clear) | set;
+	lw->ctrl_clear = (lw->ctrl_clear & ~set) | clear;
+	logiwin_stage(lw);
+
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
+
+	logiwin_ctrl_restart(lw);
+}
+
+static void logiwin_put_buf(struct logiwin *lw, struct logiwin_frame *frame)
+{
+	unsigned int head = lw->ring_head;
+
+	lw->ring[head & LOGIWIN_RING_MASK] = frame;
+	/* publish the entry before the new head */
+	smp_store_release(&lw->ring_head, head + 1);
+}
+
+static struct logiwin_frame *logiwin_get_buf(struct logiwin *lw)
+{
+	struct logiwin_frame *frame;
+	unsigned int tail = lw->ring_tail;
+
+	if (tail == smp_load_acquire(&lw->ring_head))
+		return NULL;
+
+	frame = lw->ring[tail & LOGIWIN_RING_MASK];
+	/* release the slot only after the entry has been read */
+	smp_store_release(&lw->ring_tail, tail + 1);
+
+	return frame;
+}
+
+static void logiwin_hist_add(u32 *hist, u64 ns)
+{
+	unsigned int i = ns ? (fls64(ns) - 1) : 0;
+
+	hist[min_t(unsigned int, i, LOGIWIN_HIST_BUCKETS - 1)]++;
+}
+
+/*
+ * Buffer settings, or the next region of interest, are written together
+ * with the buffer address
+ */
+static void logiwin_apply_buffer_config(struct logiwin *lw,
+					struct logiwin_frame *frame)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lw->irq_lock, flags);
+
+	frame->roi = -1;
+	if (frame->config) {
+		logiwin_load_registers(&lw->lw_par, frame->shadow);
+		frame->config = false;
+	} else if (lw->roi_count) {
+		frame->roi = lw->roi_next;
+		logiwin_load_registers(&lw->lw_par,
+				       lw->roi_shadow[lw->roi_next]);
+		lw->roi_next = (lw->roi_next + 1) % lw->roi_count;
 	}
+
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
+}
+
+static unsigned int logiwin_get_overlay_buf(struct logiwin *lw)
+{
+	if (lw->overlay.id < (LOGIWIN_DMA_BUFFERS - 1))
+		lw->overlay.id++;
+	else
+		lw->overlay.id = 0;
+
+	return lw->overlay.id;
+}
+
+/*
+ * Program logiWIN DMA target. Weave deinterlaced fields are written with
+ * double line stride, the odd field one line below the even field.
+ */
+static void logiwin_set_buffer(struct logiwin *lw, dma_addr_t pa)
+{
+	if (lw->lw_par.weave_deinterlace)
+		logiwin_set_memory_offset(&lw->lw_par, pa,
+					  pa + lw->pix_format.bytesperline);
+	else
+		logiwin_set_memory_offset(&lw->lw_par, pa, pa);
+}
+
+/*
+ * Switch logiWIN operation. Control register is also changed by the
+ * interrupt handler, its read-modify-write is done under irq_lock.
+ */
+static void logiwin_ctrl_operation(struct logiwin *lw,
+				   enum logiwin_operation op, bool enable)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lw->irq_lock, flags);
+	logiwin_operation(&lw->lw_par, op, enable ? LOGIWIN_OP_FLAG_ENABLE :
+						LOGIWIN_OP_FLAG_DISABLE);
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
 }
 
 static void logiwin_enable(struct logiwin *lw,
@@ -294,197 +853,391 @@ static void logiwin_enable(struct logiwin *lw,
 	dma_addr_t pa;
 	u32 int_mask;
 
-	if (stream_state == CAPTURE_STREAM_ON) {
-		lw->capture.id = lw->frames - 1;
-		lw->capture.id = logiwin_get_buf(lw);
-		pa = lw->capture.address[lw->capture.id].pa;
+	if (stream_state == CAPTURE_STREAM_ON &&
+	    test_bit(LOGIWIN_FLAG_CPU_BUFFER_SWITCH, &lw->flags)) {
+		/* taken at the first frame start, becomes active there */
+		lw->armed = logiwin_get_buf(lw);
+		pa = vb2_dma_contig_plane_dma_addr(&lw->armed->vb, 0);
+	} else if (stream_state == CAPTURE_STREAM_ON) {
+		lw->active = logiwin_get_buf(lw);
+		pa = vb2_dma_contig_plane_dma_addr(&lw->active->vb, 0);
 	} else if (stream_state == OVERLAY_STREAM_ON) {
 		pa = lw->overlay.address[0].pa;
-		lw->flags |= LOGIWIN_FLAG_OVERLAY_BUFFER_SWITCH;
+		set_bit(LOGIWIN_FLAG_OVERLAY_BUFFER_SWITCH, &lw->flags);
 	}
 
 	logiwin_update_registers(&lw->lw_par);
+	lw->commit_pending = false;
 
-	logiwin_set_memory_offset(&lw->lw_par, pa, pa);
+	if (stream_state == CAPTURE_STREAM_ON && lw->active) {
+		lw->roi_next = 0;
+		logiwin_apply_buffer_config(lw, lw->active);
+	}
+
+	logiwin_set_buffer(lw, pa);
+
+	/* frame store may be left stopped when capture was starved */
+	logiwin_ctrl_operation(lw, LOGIWIN_OP_FRAME_STORED_STOP, false);
+
+	if (test_bit(LOGIWIN_FLAG_CPU_BUFFER_SWITCH, &lw->flags)) {
+		logiwin_ctrl_operation(lw, LOGIWIN_OP_CPU_VBUFF_SWITCH,
+				       stream_state == CAPTURE_STREAM_ON);
+		if (stream_state == CAPTURE_STREAM_ON)
+			logiwin_buffer_switch(&lw->lw_par);
+	}
 
 	int_mask = LOGIWIN_INT_RESOLUTION;
-	if (!(lw->flags & LOGIWIN_FLAG_HW_BUFFER_SWITCH))
+	if (!test_bit(LOGIWIN_FLAG_HW_BUFFER_SWITCH, &lw->flags))
 		int_mask |= LOGIWIN_INT_FRAME_START;
 	logiwin_int_stat_clear(&lw->lw_par, 0);
 	logiwin_int(&lw->lw_par, int_mask, true);
 
 	lw->frames_skip = 0;
 	lw->frame_seq = 0;
+	lw->torn_seq = 0;
+	lw->field_period = 0;
+	lw->fields_missed = 0;
 
 	lw->stream_state = stream_state;
 
-	logiwin_operation(&lw->lw_par, LOGIWIN_OP_ENABLE,
-			  LOGIWIN_OP_FLAG_ENABLE);
+	logiwin_ctrl_operation(lw, LOGIWIN_OP_ENABLE, true);
 }
 
+/*
+ * Interrupts are masked and handlers finished before logiWIN is disabled,
+ * so neither writes back a control register value with logiWIN enabled
+ * or restarts it after the buffers were returned.
+ */
 static void logiwin_disable(struct logiwin *lw)
 {
-	logiwin_operation(&lw->lw_par, LOGIWIN_OP_ENABLE,
-			  LOGIWIN_OP_FLAG_DISABLE);
+	unsigned long flags;
 
 	logiwin_int(&lw->lw_par, LOGIWIN_INT_ALL, false);
+	synchronize_irq(lw->lw_hw.irq);
 
+	spin_lock_irqsave(&lw->irq_lock, flags);
+	clear_bit(LOGIWIN_FLAG_CTRL_RESTART, &lw->flags);
 	lw->stream_state = STREAM_OFF;
+	logiwin_operation(&lw->lw_par, LOGIWIN_OP_ENABLE,
+			  LOGIWIN_OP_FLAG_DISABLE);
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
 
-	lw->flags &= ~LOGIWIN_FLAG_OVERLAY_BUFFER_SWITCH;
+	clear_bit(LOGIWIN_FLAG_OVERLAY_BUFFER_SWITCH, &lw->flags);
 
 	wake_up_interruptible(&lw->wait_buff_switch);
-	wake_up(&lw->wait_frame);
 	wake_up_interruptible(&lw->wait_resolution);
 }
 
-static void logiwin_empty_queues(struct logiwin *lw)
+static void logiwin_return_buffers(struct logiwin *lw,
+				   enum vb2_buffer_state state)
 {
+	struct logiwin_frame *frame;
 	unsigned long flags;
-	int i;
 
 	LW_DBG(INFO, "");
 
 	spin_lock_irqsave(&lw->irq_lock, flags);
+	frame = lw->active;
+	lw->active = NULL;
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
 
-	INIT_LIST_HEAD(&lw->inqueue);
-	INIT_LIST_HEAD(&lw->outqueue);
-
-	for (i = 0; i < lw->frames; i++) {
-		lw->frame[i].state = FRAME_DEQUEUED;
-		lw->frame[i].buf.bytesused = 0;
-		lw->frame[i].buf.sequence = 0;
+	if (frame) {
+		frame->config = false;
+		vb2_buffer_done(&frame->vb, state);
 	}
 
-	lw->frames_queue = 0;
+	if (lw->armed) {
+		lw->armed->config = false;
+		vb2_buffer_done(&lw->armed->vb, state);
+		lw->armed = NULL;
+	}
 
-	spin_unlock_irqrestore(&lw->irq_lock, flags);
+	while ((frame = logiwin_get_buf(lw))) {
+		frame->config = false;
+		vb2_buffer_done(&frame->vb, state);
+	}
 }
 
-static unsigned int logiwin_request_buffers(struct logiwin *lw,
-					    unsigned int count)
+static void logiwin_release_overlay_buffers(struct logiwin *lw)
 {
 	int i;
 
 	LW_DBG(INFO, "");
 
-	if (count > LOGIWIN_DMA_BUFFERS) {
-		count = LOGIWIN_DMA_BUFFERS;
-		dev_warn(lw->dev, "buffer count set to %d\n",
-			 LOGIWIN_DMA_BUFFERS);
+	for (i = 0; i < LOGIWIN_DMA_BUFFERS; i++)
+		lw->overlay.address[i].pa = 0;
+	lw->overlay.size = 0;
+}
+
+static void logiwin_mem_put(void *buf_priv)
+{
+	struct logiwin_mem_buf *buf = buf_priv;
+
+	if (!atomic_dec_and_test(&buf->refcount))
+		return;
+
+	dma_unmap_page(buf->dev, buf->dma_addr, buf->size, DMA_FROM_DEVICE);
+	dma_release_from_contiguous(buf->dev, buf->pages,
+				    PAGE_ALIGN(buf->size) >> PAGE_SHIFT);
+	kfree(buf);
+}
+
+static void *logiwin_mem_alloc(void *alloc_ctx, unsigned long size,
+			       gfp_t gfp_flags)
+{
+	struct logiwin *lw = alloc_ctx;
+	struct logiwin_mem_buf *buf;
+	size_t count = PAGE_ALIGN(size) >> PAGE_SHIFT;
+
+	/* CMA allocator is not exported to modules */
+	if (!IS_ENABLED(CONFIG_XYLON_LOGIWIN_CACHED))
+		return ERR_PTR(-EINVAL);
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return ERR_PTR(-ENOMEM);
+
+	buf->dev = lw->dev;
+	buf->size = size;
+
+	/*
+	 * Cached buffers are taken from CMA, which stays in the kernel linear
+	 * mapping, and mapped for streaming DMA, so that dma_sync_single_*
+	 * can maintain them and the user mapping attributes match the kernel
+	 * ones. Coherent memory can not be synced that way.
+	 */
+	buf->pages = dma_alloc_from_contiguous(buf->dev, count, 0);
+	if (!buf->pages)
+		goto error_alloc;
+	if (PageHighMem(buf->pages)) {
+		dma_release_from_contiguous(buf->dev, buf->pages, count);
+		goto error_alloc;
+	}
+	buf->dma_addr = dma_map_page(buf->dev, buf->pages, 0, size,
+				     DMA_FROM_DEVICE);
+	if (dma_mapping_error(buf->dev, buf->dma_addr)) {
+		dma_release_from_contiguous(buf->dev, buf->pages, count);
+		goto error_alloc;
 	}
 
-	lw->capture.id = 0;
-	lw->frames = 0;
+	buf->handler.refcount = &buf->refcount;
+	buf->handler.put = logiwin_mem_put;
+	buf->handler.arg = buf;
 
-	lw->capture.size = lw->pix_format.sizeimage;
+	atomic_inc(&buf->refcount);
 
-	if (lw->lw_hw.vmem_pbase) {
-		for (i = 0; i < count; i++) {
-			lw->capture.address[i].pa =
-				lw->lw_hw.vmem_pbase + (i * lw->capture.size);
-#ifdef LOGIWIN_MMAP_VMEM
-			lw->capture.address[i].va =
-				lw->lw_hw.vmem_base + (i * lw->capture.size);
-#endif
-			lw->frames++;
-		}
-	} else {
-		/*
-		 * create "count" buffers, or try to create at least one buffer
-		 */
-		for (i = 0; i < count; i++) {
-			lw->capture.address[i].va =
-				dma_alloc_coherent(lw->dev,
-						   lw->capture.size,
-						   &lw->capture.address[i].pa,
-						   GFP_KERNEL);
-			LW_DBG(INFO, "PA 0x%X : VA 0x%X",
-				lw->capture.address[i].pa,
-				(unsigned int)lw->capture.address[i].va);
-			if (lw->capture.address[i].va == NULL)
-				break;
-			lw->frames++;
-		}
-		LW_DBG(INFO, "DMA frame buffers created %d", lw->frames);
-		if (lw->frames == 0)
-			return 0;
+	return buf;
+
+error_alloc:
+	dev_err(buf->dev, "failed alloc CMA buffer of %lu bytes\n", size);
+	kfree(buf);
+	return ERR_PTR(-ENOMEM);
+}
+
+static void *logiwin_mem_cookie(void *buf_priv)
+{
+	struct logiwin_mem_buf *buf = buf_priv;
+
+	return &buf->dma_addr;
+}
+
+static unsigned int logiwin_mem_num_users(void *buf_priv)
+{
+	struct logiwin_mem_buf *buf = buf_priv;
+
+	return atomic_read(&buf->refcount);
+}
+
+static int logiwin_mem_mmap(void *buf_priv, struct vm_area_struct *vma)
+{
+	struct logiwin_mem_buf *buf = buf_priv;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int ret;
+
+	if (size > PAGE_ALIGN(buf->size))
+		return -EINVAL;
+
+	ret = remap_pfn_range(vma, vma->vm_start, page_to_pfn(buf->pages),
+			      size, vma->vm_page_prot);
+	if (ret) {
+		dev_err(buf->dev, "failed address mapping\n");
+		return ret;
 	}
 
-	lw->frame = kzalloc((sizeof(struct logiwin_frame) * lw->frames),
-			     GFP_KERNEL);
-	if (lw->frame == NULL)
-		goto error_handle;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_private_data = &buf->handler;
+	vma->vm_ops = &vb2_common_vm_ops;
 
-	for (i = 0; i < lw->frames; i++) {
-		lw->frame[i].state = FRAME_UNUSED;
-		atomic_set(&lw->frame[i].vma_refcnt, 0);
-		lw->frame[i].buff_addr = lw->capture.address[i].pa;
-		lw->frame[i].buf.index = i;
-		if (lw->lw_hw.vmem_pbase)
-			lw->frame[i].buf.m.offset = i * lw->capture.size;
-		else
-			lw->frame[i].buf.m.offset = lw->capture.address[i].pa;
-		lw->frame[i].buf.length = lw->capture.size;
-		lw->frame[i].buf.bytesused = 0;
-		lw->frame[i].buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		lw->frame[i].buf.sequence = 0;
-		lw->frame[i].buf.field = V4L2_FIELD_NONE;
-		lw->frame[i].buf.memory = V4L2_MEMORY_MMAP;
-		lw->frame[i].buf.flags = 0;
+	vma->vm_ops->open(vma);
+
+	return 0;
+}
+
+/*
+ * Memory operations for cached capture buffers, write-combined buffers use
+ * dma-contig memory operations.
+ */
+static const struct vb2_mem_ops logiwin_memops = {
+	.alloc = logiwin_mem_alloc,
+	.put = logiwin_mem_put,
+	.cookie = logiwin_mem_cookie,
+	.num_users = logiwin_mem_num_users,
+	.mmap = logiwin_mem_mmap,
+};
+
+static int logiwin_queue_setup(struct vb2_queue *vq,
+			       const struct v4l2_format *fmt,
+			       unsigned int *nbuffers, unsigned int *nplanes,
+			       unsigned int sizes[], void *alloc_ctxs[])
+{
+	struct logiwin *lw = vb2_get_drv_priv(vq);
+	unsigned int size = lw->pix_format.sizeimage;
+
+	LW_DBG(INFO, "");
+
+	if (fmt) {
+		if (fmt->fmt.pix.sizeimage < size)
+			return -EINVAL;
+		size = fmt->fmt.pix.sizeimage;
 	}
 
-	lw->frames_queue = 0;
+	if (*nbuffers < LOGIWIN_MIN_BUFFERS)
+		*nbuffers = LOGIWIN_MIN_BUFFERS;
+	else if (*nbuffers > LOGIWIN_MAX_BUFFERS)
+		*nbuffers = LOGIWIN_MAX_BUFFERS;
 
-	lw->flags |= LOGIWIN_FLAG_BUFFERS_AVAILABLE;
+	*nplanes = 1;
+	sizes[0] = size;
+	alloc_ctxs[0] = lw->alloc_ctx;
 
-	return lw->frames;
+	return 0;
+}
 
-error_handle:
-	if (!lw->lw_hw.vmem_pbase)
-		for (i = lw->frames - 1; i >= 0; i--)
-			dma_free_coherent(lw->dev,
-					  lw->capture.size,
-					  lw->capture.address[i].va,
-					  lw->capture.address[i].pa);
+static int logiwin_buf_prepare(struct vb2_buffer *vb)
+{
+	struct logiwin *lw = vb2_get_drv_priv(vb->vb2_queue);
+	unsigned long size = lw->pix_format.sizeimage;
+	dma_addr_t pa;
+
+	/*
+	 * logiWIN writes lines with fixed memory stride, so the buffer must
+	 * hold pix_format.bytesperline for every line of the frame.
+	 */
+	if (vb2_plane_size(vb, 0) < size) {
+		dev_err(lw->dev, "buffer too small (%lu < %lu)\n",
+			vb2_plane_size(vb, 0), size);
+		return -EINVAL;
+	}
+
+	/*
+	 * Imported buffers are contiguous (checked by dma-contig on map), but
+	 * logiWIN memory offset registers are 32 bit wide.
+	 */
+	if (vb->v4l2_buf.memory == V4L2_MEMORY_DMABUF) {
+		pa = vb2_dma_contig_plane_dma_addr(vb, 0);
+		if (upper_32_bits(pa + size - 1)) {
+			dev_err(lw->dev, "buffer out of logiWIN range\n");
+			return -EINVAL;
+		}
+	}
+
+	vb2_set_plane_payload(vb, 0, size);
 
-	return -ENOMEM;
+	/* drop stale cache lines before logiWIN writes the buffer */
+	if ((lw->cache_mode == LOGIWIN_CACHE_CACHED) &&
+	    !(vb->v4l2_buf.flags & V4L2_BUF_FLAG_NO_CACHE_CLEAN))
+		dma_sync_single_for_device(lw->dev,
+					   vb2_dma_contig_plane_dma_addr(vb, 0),
+					   size, DMA_FROM_DEVICE);
+
+	return 0;
 }
 
-static void logiwin_release_buffers(struct logiwin *lw)
+static void logiwin_buf_finish(struct vb2_buffer *vb)
 {
-	int i;
+	struct logiwin *lw = vb2_get_drv_priv(vb->vb2_queue);
+
+	if (vb->state == VB2_BUF_STATE_DONE) {
+		trace_logiwin_dqbuf(lw->video_dev.minor, vb->v4l2_buf.index,
+				    vb->v4l2_buf.sequence,
+				    to_logiwin_frame(vb)->ts);
+		logiwin_hist_add(lw->stats.dqbuf_latency,
+				 ktime_get_ns() - to_logiwin_frame(vb)->ts);
+	}
+
+	/*
+	 * Invalidate lines speculatively loaded while logiWIN wrote buffer.
+	 * With V4L2_BUF_FLAG_NO_CACHE_INVALIDATE application invalidates only
+	 * the area it reads using LOGIWIN_IOCTL_BUFFER_SYNC.
+	 */
+	if ((lw->cache_mode == LOGIWIN_CACHE_CACHED) &&
+	    !(vb->v4l2_buf.flags & V4L2_BUF_FLAG_NO_CACHE_INVALIDATE))
+		dma_sync_single_for_cpu(lw->dev,
+					vb2_dma_contig_plane_dma_addr(vb, 0),
+					vb2_get_plane_payload(vb, 0),
+					DMA_FROM_DEVICE);
+}
+
+static void logiwin_buf_queue(struct vb2_buffer *vb)
+{
+	struct logiwin *lw = vb2_get_drv_priv(vb->vb2_queue);
+
+	trace_logiwin_qbuf(lw->video_dev.minor, vb->v4l2_buf.index,
+			   lw->frame_seq, lw->frame_ts);
+
+	logiwin_put_buf(lw, to_logiwin_frame(vb));
+}
+
+static int logiwin_start_streaming(struct vb2_queue *vq, unsigned int count)
+{
+	struct logiwin *lw = vb2_get_drv_priv(vq);
 
 	LW_DBG(INFO, "");
 
-	kfree(lw->frame);
-	lw->frame = NULL;
-	if (!lw->lw_hw.vmem_pbase)
-		for (i = lw->frames - 1; i >= 0; i--)
-			dma_free_coherent(lw->dev,
-					  lw->capture.size,
-					  lw->capture.address[i].va,
-					  lw->capture.address[i].pa);
+	if (lw->stream_state != STREAM_OFF) {
+		logiwin_return_buffers(lw, VB2_BUF_STATE_QUEUED);
+		return -EBUSY;
+	}
 
-	lw->frames = 0;
-	lw->frames_queue = 0;
+	/*
+	 * With hw-buffer-switch logiWIN rotates through overlay buffers on
+	 * its own and does not report the buffer it writes, so captured
+	 * buffers can not be returned.
+	 */
+	if (test_bit(LOGIWIN_FLAG_HW_BUFFER_SWITCH, &lw->flags)) {
+		dev_err(lw->dev, "failed capture, hw buffer switch\n");
+		logiwin_return_buffers(lw, VB2_BUF_STATE_QUEUED);
+		return -EINVAL;
+	}
 
-	lw->flags &= ~LOGIWIN_FLAG_BUFFERS_AVAILABLE;
+	logiwin_enable(lw, CAPTURE_STREAM_ON);
+
+	return 0;
 }
 
-static void logiwin_release_overlay_buffers(struct logiwin *lw)
+static void logiwin_stop_streaming(struct vb2_queue *vq)
 {
-	int i;
+	struct logiwin *lw = vb2_get_drv_priv(vq);
 
 	LW_DBG(INFO, "");
 
-	for (i = 0; i < lw->frames; i++)
-		lw->overlay.address[i].pa = 0;
-	lw->overlay.size = 0;
+	if (lw->stream_state == CAPTURE_STREAM_ON)
+		logiwin_disable(lw);
 
-	lw->frames = 0;
+	logiwin_return_buffers(lw, VB2_BUF_STATE_ERROR);
 }
 
+static struct vb2_ops logiwin_vb2_ops = {
+	.queue_setup = logiwin_queue_setup,
+	.buf_prepare = logiwin_buf_prepare,
+	.buf_finish = logiwin_buf_finish,
+	.buf_queue = logiwin_buf_queue,
+	.start_streaming = logiwin_start_streaming,
+	.stop_streaming = logiwin_stop_streaming,
+	.wait_prepare = vb2_ops_wait_prepare,
+	.wait_finish = vb2_ops_wait_finish,
+};
+
 static int vidioc_querycap(struct file *file, void *fh,
 			   struct v4l2_capability *cap)
 {
@@ -503,7 +1256,7 @@ static int vidioc_querycap(struct file *file, void *fh,
 static int vidioc_enum_fmt_vid_cap(struct file *file, void *fh,
 				   struct v4l2_fmtdesc *fmt)
 {
-	struct logiwin *lw = fh;
+	struct logiwin *lw = video_drvdata(file);
 
 	LW_DBG(INFO, "");
 
@@ -521,7 +1274,7 @@ static int vidioc_enum_fmt_vid_cap(struct file *file, void *fh,
 static int vidioc_g_fmt_vid_cap(struct file *file, void *fh,
 				struct v4l2_format *f)
 {
-	struct logiwin *lw = fh;
+	struct logiwin *lw = video_drvdata(file);
 
 	LW_DBG(INFO, "");
 
@@ -533,24 +1286,53 @@ static int vidioc_g_fmt_vid_cap(struct file *file, void *fh,
 	return 0;
 }
 
+static int logiwin_check_buffers(struct logiwin *lw, unsigned long size)
+{
+	int i, ret = 0;
+
+	mutex_lock(&lw->queue_lock);
+
+	for (i = 0; i < lw->queue.num_buffers; i++) {
+		if (vb2_plane_size(lw->queue.bufs[i], 0) < size) {
+			ret = -EBUSY;
+			break;
+		}
+	}
+
+	mutex_unlock(&lw->queue_lock);
+
+	return ret;
+}
+
 static int vidioc_s_fmt_vid_cap(struct file *file, void *fh,
 				struct v4l2_format *f)
 {
-	struct logiwin *lw = fh;
+	struct logiwin *lw = video_drvdata(file);
 	struct v4l2_pix_format *pix = &f->fmt.pix;
+	struct logiwin_parameters lw_par;
 	unsigned int dummy = 0;
+	unsigned long flags;
+	u32 ctrl, set, clear;
 
 	LW_DBG(INFO, "");
 
 	if (f->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
 		return -EINVAL;
 
-	if ((pix->field == V4L2_FIELD_NONE) || (pix->field == V4L2_FIELD_ANY))
-		lw->flags &= ~LOGIWIN_FLAG_DEINTERLACE;
-	else if (pix->field == V4L2_FIELD_INTERLACED)
-		lw->flags |= LOGIWIN_FLAG_DEINTERLACE;
-	else
+	switch (pix->field) {
+	case V4L2_FIELD_ANY:
+		pix->field = V4L2_FIELD_NONE;
+		/* fall through */
+	case V4L2_FIELD_NONE:
+		break;
+	case V4L2_FIELD_INTERLACED:
+	case V4L2_FIELD_ALTERNATE:
+		if (lw->lw_par.input_format != LOGIWIN_FORMAT_INPUT_ITU)
+			return -EINVAL;
+		break;
+	default:
 		return -EINVAL;
+	}
 
 	if (pix->width > lw->lw_cfg.output_hres)
 		pix->width = lw->lw_cfg.output_hres;
@@ -561,22 +1343,80 @@ static int vidioc_s_fmt_vid_cap(struct file *file, void *fh,
 	pix->sizeimage = pix->bytesperline * pix->height;
 	pix->colorspace = lw->pix_format.colorspace;
 
-	logiwin_set_rect_parameters(&lw->lw_par, 0, 0, pix->width, pix->height,
+	/*
+	 * Format is changed while buffers are allocated or streaming, as long
+	 * as the frame fits the allocated buffers.
+	 */
+	if (logiwin_check_buffers(lw, pix->sizeimage))
+		return -EBUSY;
+
+	mutex_lock(&lw->ioctl_lock);
+
+	/*
+	 * Regions of interest and animated windows were checked against the
+	 * current format, buffers allocated for a smaller one would not hold
+	 * them.
+	 */
+	if (((pix->width < lw->pix_format.width) ||
+	     (pix->height < lw->pix_format.height)) &&
+	    (lw->roi_count || (lw->anim_active &&
+			       (lw->anim.flags & LOGIWIN_ANIMATION_WINDOW)))) {
+		mutex_unlock(&lw->ioctl_lock);
+		return -EBUSY;
+	}
+
+	/* field mode and geometry are validated together on a copy */
+	spin_lock_irqsave(&lw->irq_lock, flags);
+	lw_par = lw->lw_par;
+	ctrl = lw_par.ctrl;
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
+
+	lw_par.hw_access = false;
+
+	if (lw_par.weave_deinterlace != (pix->field == V4L2_FIELD_INTERLACED))
+		logiwin_weave_deinterlace(&lw_par,
+					  pix->field == V4L2_FIELD_INTERLACED);
+	/* each field is written to its own buffer */
+	logiwin_operation(&lw_par, LOGIWIN_OP_EVEN_FIELD_VBUFF_SWITCH,
+			  (pix->field == V4L2_FIELD_ALTERNATE) ?
+			  LOGIWIN_OP_FLAG_ENABLE : LOGIWIN_OP_FLAG_DISABLE);
+
+	logiwin_set_rect_parameters(&lw_par, 0, 0, pix->width, pix->height,
 				    LOGIWIN_RECTANGLE_OUT);
-	if (logiwin_set_scale(&lw->lw_par))
+	if (logiwin_set_scale(&lw_par)) {
+		mutex_unlock(&lw->ioctl_lock);
 		return -EINVAL;
+	}
+
+	set = lw_par.ctrl & ~ctrl;
+	clear = ctrl & ~lw_par.ctrl;
+
+	if (pix->field == V4L2_FIELD_INTERLACED)
+		set_bit(LOGIWIN_FLAG_DEINTERLACE, &lw->flags);
+	else
+		clear_bit(LOGIWIN_FLAG_DEINTERLACE, &lw->flags);
 
-	lw->flags |= LOGIWIN_FLAG_UPDATE_REGISTERS;
+	spin_lock_irqsave(&lw->irq_lock, flags);
+
+	logiwin_copy_geometry(lw, &lw_par);
+	lw->ctrl_set = (lw->ctrl_set & ~clear) | set;
+	lw->ctrl_clear = (lw->ctrl_clear & ~set) | clear;
+	logiwin_stage(lw);
+
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
 
-	logiwin_get_rect_parameters(&lw->lw_par, &dummy, &dummy,
+	logiwin_ctrl_restart(lw);
+
+	logiwin_get_rect_parameters(&lw_par, &dummy, &dummy,
 				    &pix->width, &pix->height,
 				    LOGIWIN_RECTANGLE_OUT);
+	/* weave deinterlaced height is rounded to a whole number of fields */
+	pix->sizeimage = pix->bytesperline * pix->height;
 	lw->pix_format = *pix;
 
 	logiwin_set_video_norm(&lw->video_norm, pix->width, pix->height);
 
-	if (lw->flags & LOGIWIN_FLAG_HW_BUFFER_SWITCH)
-		tasklet_schedule(&lw->tasklet);
+	mutex_unlock(&lw->ioctl_lock);
 
 	return 0;
 }
@@ -584,7 +1424,7 @@ static int vidioc_s_fmt_vid_cap(struct file *file, void *fh,
 static int vidioc_try_fmt_vid_cap(struct file *file, void *fh,
 				  struct v4l2_format *f)
 {
-	struct logiwin *lw = fh;
+	struct logiwin *lw = video_drvdata(file);
 	struct v4l2_pix_format *pix = &f->fmt.pix;
 
 	LW_DBG(INFO, "");
@@ -592,9 +1432,12 @@ static int vidioc_try_fmt_vid_cap(struct file *file, void *fh,
 	if (f->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
 		return -EINVAL;
 
-	if ((f->fmt.pix.field != V4L2_FIELD_NONE) ||
-	    (f->fmt.pix.field != V4L2_FIELD_ANY) ||
-	    (f->fmt.pix.field != V4L2_FIELD_INTERLACED))
+	if (pix->field == V4L2_FIELD_ANY)
+		pix->field = V4L2_FIELD_NONE;
+	if ((pix->field != V4L2_FIELD_NONE) &&
+	    (((pix->field != V4L2_FIELD_INTERLACED) &&
+	      (pix->field != V4L2_FIELD_ALTERNATE)) ||
+	     (lw->lw_par.input_format != LOGIWIN_FORMAT_INPUT_ITU)))
 		return -EINVAL;
 
 	if (pix->width > lw->lw_cfg.output_hres)
@@ -612,7 +1455,7 @@ static int vidioc_try_fmt_vid_cap(struct file *file, void *fh,
 static int vidioc_enum_fmt_vid_overlay(struct file *file, void *fh,
 				       struct v4l2_fmtdesc *fmt)
 {
-	struct logiwin *lw = fh;
+	struct logiwin *lw = video_drvdata(file);
 
 	LW_DBG(INFO, "");
 
@@ -630,7 +1473,7 @@ static int vidioc_enum_fmt_vid_overlay(struct file *file, void *fh,
 static int vidioc_g_fmt_vid_overlay(struct file *file, void *fh,
 				    struct v4l2_format *f)
 {
-	struct logiwin *lw = fh;
+	struct logiwin *lw = video_drvdata(file);
 
 	LW_DBG(INFO, "");
 
@@ -650,8 +1493,10 @@ static int vidioc_g_fmt_vid_overlay(struct file *file, void *fh,
 static int vidioc_s_fmt_vid_overlay(struct file *file, void *fh,
 				    struct v4l2_format *f)
 {
-	struct logiwin *lw = fh;
+	struct logiwin *lw = video_drvdata(file);
 	struct v4l2_window *win = &f->fmt.win;
+	struct logiwin_parameters lw_par;
+	unsigned long flags;
 
 	LW_DBG(INFO, "");
 
@@ -659,27 +1504,36 @@ static int vidioc_s_fmt_vid_overlay(struct file *file, void *fh,
 		return -EINVAL;
 
 	if ((win->field == V4L2_FIELD_NONE) || (win->field == V4L2_FIELD_ANY))
-		lw->flags &= ~LOGIWIN_FLAG_DEINTERLACE;
+		clear_bit(LOGIWIN_FLAG_DEINTERLACE, &lw->flags);
 	else if (win->field == V4L2_FIELD_INTERLACED)
-		lw->flags |= LOGIWIN_FLAG_DEINTERLACE;
+		set_bit(LOGIWIN_FLAG_DEINTERLACE, &lw->flags);
 	else
 		return -EINVAL;
 
+	mutex_lock(&lw->ioctl_lock);
+
 	logiwin_set_pixel_alpha(&lw->lw_par, win->global_alpha);
 
-	logiwin_set_rect_parameters(&lw->lw_par, win->w.left, win->w.top,
+	spin_lock_irqsave(&lw->irq_lock, flags);
+	lw_par = lw->lw_par;
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
+	lw_par.hw_access = false;
+
+	logiwin_set_rect_parameters(&lw_par, win->w.left, win->w.top,
 				    win->w.width, win->w.height,
 				    LOGIWIN_RECTANGLE_OUT);
 
-	lw->flags |= LOGIWIN_FLAG_UPDATE_REGISTERS;
+	spin_lock_irqsave(&lw->irq_lock, flags);
+	logiwin_copy_geometry(lw, &lw_par);
+	logiwin_stage(lw);
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
 
-	logiwin_get_rect_parameters(&lw->lw_par, &win->w.left, &win->w.top,
+	logiwin_get_rect_parameters(&lw_par, &win->w.left, &win->w.top,
 				    &win->w.width, &win->w.height,
 				    LOGIWIN_RECTANGLE_OUT);
 	lw->window = *win;
 
-	if (lw->flags & LOGIWIN_FLAG_HW_BUFFER_SWITCH)
-		tasklet_schedule(&lw->tasklet);
+	mutex_unlock(&lw->ioctl_lock);
 
 	return 0;
 }
@@ -687,7 +1541,7 @@ static int vidioc_s_fmt_vid_overlay(struct file *file, void *fh,
 static int vidioc_try_fmt_vid_overlay(struct file *file, void *fh,
 				      struct v4l2_format *f)
 {
-	struct logiwin *lw = fh;
+	struct logiwin *lw = video_drvdata(file);
 	struct v4l2_window *win = &f->fmt.win;
 
 	LW_DBG(INFO, "");
@@ -696,9 +1550,9 @@ static int vidioc_try_fmt_vid_overlay(struct file *file, void *fh,
 		return -EINVAL;
 
 	if ((win->field == V4L2_FIELD_NONE) || (win->field == V4L2_FIELD_ANY))
-		lw->flags &= ~LOGIWIN_FLAG_DEINTERLACE;
+		clear_bit(LOGIWIN_FLAG_DEINTERLACE, &lw->flags);
 	else if (win->field == V4L2_FIELD_INTERLACED)
-		lw->flags |= LOGIWIN_FLAG_DEINTERLACE;
+		set_bit(LOGIWIN_FLAG_DEINTERLACE, &lw->flags);
 	else
 		return -EINVAL;
 
@@ -716,7 +1570,7 @@ static int vidioc_try_fmt_vid_overlay(struct file *file, void *fh,
 
 static int vidioc_g_std(struct file *file, void *fh, v4l2_std_id *norm)
 {
-	struct logiwin *lw = fh;
+	struct logiwin *lw = video_drvdata(file);
 
 	LW_DBG(INFO, "");
 
@@ -727,7 +1581,7 @@ static int vidioc_g_std(struct file *file, void *fh, v4l2_std_id *norm)
 
 static int vidioc_s_std(struct file *file, void *fh, v4l2_std_id norm)
 {
-	struct logiwin *lw = fh;
+	struct logiwin *lw = video_drvdata(file);
 
 	LW_DBG(INFO, "");
 
@@ -740,7 +1594,7 @@ static int vidioc_s_std(struct file *file, void *fh, v4l2_std_id norm)
 static int vidioc_enum_input(struct file *file, void *fh,
 			     struct v4l2_input *inp)
 {
-	struct logiwin *lw = fh;
+	struct logiwin *lw = video_drvdata(file);
 	char str[32] = "logiWIN input ";
 
 	LW_DBG(INFO, "");
@@ -771,214 +1625,67 @@ static int vidioc_enum_input(struct file *file, void *fh,
 }
 
 static int vidioc_g_input(struct file *file, void *fh, unsigned int *channel)
-{
-	struct logiwin *lw = fh;
-
-	LW_DBG(INFO, "");
-
-	*channel = lw->lw_par.channel_id;
-
-	return 0;
-}
-
-static int vidioc_s_input(struct file *file, void *fh, unsigned int channel)
-{
-	struct logiwin *lw = fh;
-
-	LW_DBG(INFO, "");
-
-	if ((channel < 0) && (channel > 1))
-		return -EINVAL;
-
-	logiwin_select_input_ch(&lw->lw_par, channel);
-
-	return 0;
-}
-
-static int vidioc_g_parm(struct file *file, void *fh,
-			 struct v4l2_streamparm *sp)
-{
-	struct logiwin *lw = fh;
-
-	LW_DBG(INFO, "");
-
-	if (sp->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
-		return -EINVAL;
-
-	sp->parm.capture.capability = 0;
-	sp->parm.capture.capturemode = 0;
-	sp->parm.capture.extendedmode = 0;
-	sp->parm.capture.readbuffers = lw->frames;
-
-	return 0;
-}
-
-static int vidioc_enum_framesizes(struct file *file, void *fh,
-				  struct v4l2_frmsizeenum *fsize)
-{
-	struct logiwin *lw = fh;
-
-	LW_DBG(INFO, "");
-
-	if ((fsize->index != 0) ||
-	    (fsize->pixel_format != lw->pix_format.pixelformat))
-		return -EINVAL;
-
-	fsize->type = V4L2_FRMSIZE_TYPE_DISCRETE;
-	fsize->discrete.width = lw->video_norm.width;
-	fsize->discrete.height = lw->video_norm.height;
-
-	return 0;
-}
-
-static int vidioc_reqbufs(struct file *file, void *fh,
-			  struct v4l2_requestbuffers *rb)
-{
-	struct logiwin *lw = fh;
-	int i;
-
-	LW_DBG(INFO, "");
-
-	if (rb->type != V4L2_BUF_TYPE_VIDEO_CAPTURE ||
-	    rb->memory != V4L2_MEMORY_MMAP)
-		return -EINVAL;
-
-	if (rb->count == 0 && lw->frames) {
-		lw->flags |= LOGIWIN_FLAG_BUFFERS_DESTROY;
-		return 0;
-	} else if (rb->count && rb->count != lw->frames) {
-		lw->flags |= LOGIWIN_FLAG_BUFFERS_REALLOCATE;
-		for (i = 0; i < lw->frames; i++)
-			while (lw->frame[i].state != FRAME_UNUSED)
-				mdelay(100);
-		logiwin_release_buffers(lw);
-		rb->count = logiwin_request_buffers(lw, rb->count);
-	} else if (rb->count && lw->frames == 0) {
-		rb->count = logiwin_request_buffers(lw, rb->count);
-	}
-
-	if (rb->count == 0)
-		return -ENOMEM;
-
-	logiwin_empty_queues(lw);
-
-	return 0;
-}
-
-static int vidioc_querybuf(struct file *file, void *fh, struct v4l2_buffer *b)
-{
-	struct logiwin *lw = fh;
-
-	LW_DBG(INFO, "");
-
-	if (b->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || b->index >= lw->frames)
-		return -EINVAL;
-
-	if (!(lw->flags & LOGIWIN_FLAG_BUFFERS_AVAILABLE))
-		return -ENOMEM;
+{
+	struct logiwin *lw = video_drvdata(file);
 
-	*b = lw->frame[b->index].buf;
+	LW_DBG(INFO, "");
 
-	if (atomic_read(&lw->frame[b->index].vma_refcnt))
-		b->flags |= V4L2_BUF_FLAG_MAPPED;
-	if (lw->frame[b->index].state == FRAME_DONE)
-		b->flags |= V4L2_BUF_FLAG_DONE;
-	else if (lw->frame[b->index].state == FRAME_QUEUED)
-		b->flags |= V4L2_BUF_FLAG_QUEUED;
+	*channel = lw->lw_par.channel_id;
 
 	return 0;
 }
 
-static int vidioc_qbuf(struct file *file, void *fh, struct v4l2_buffer *b)
+static int vidioc_s_input(struct file *file, void *fh, unsigned int channel)
 {
-	struct logiwin *lw = fh;
+	struct logiwin *lw = video_drvdata(file);
 	unsigned long flags;
 
 	LW_DBG(INFO, "");
 
-	if (b->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || b->index >= lw->frames)
-		return -EINVAL;
-
-	if (!(lw->flags & LOGIWIN_FLAG_BUFFERS_AVAILABLE))
-		return -ENOMEM;
-
-	if (b->memory != V4L2_MEMORY_MMAP)
+	if ((channel < 0) && (channel > 1))
 		return -EINVAL;
 
-	if (lw->frame[b->index].state != FRAME_DEQUEUED)
-		return -EAGAIN;
-
+	mutex_lock(&lw->ioctl_lock);
 	spin_lock_irqsave(&lw->irq_lock, flags);
-
-	list_add_tail(&lw->frame[b->index].frame, &lw->inqueue);
-	lw->frame[b->index].state = FRAME_QUEUED;
-
-	if (atomic_read(&lw->frame[b->index].vma_refcnt))
-		b->flags |= V4L2_BUF_FLAG_MAPPED;
-	b->flags |= V4L2_BUF_FLAG_QUEUED;
-	b->flags &= ~V4L2_BUF_FLAG_DONE;
-
-	lw->frames_queue++;
-
+	logiwin_select_input_ch(&lw->lw_par, channel);
 	spin_unlock_irqrestore(&lw->irq_lock, flags);
+	mutex_unlock(&lw->ioctl_lock);
 
 	return 0;
 }
 
-static int vidioc_dqbuf(struct file *file, void *fh, struct v4l2_buffer *b)
+static int vidioc_g_parm(struct file *file, void *fh,
+			 struct v4l2_streamparm *sp)
 {
-	struct logiwin *lw = fh;
-	struct logiwin_frame *frame;
-	int ret = 0;
-	unsigned long flags;
+	struct logiwin *lw = video_drvdata(file);
 
 	LW_DBG(INFO, "");
 
-	if (b->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+	if (sp->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
 		return -EINVAL;
 
-	if (!(lw->flags & LOGIWIN_FLAG_BUFFERS_AVAILABLE) ||
-	    b->index >= lw->frames)
-		return -ENOMEM;
-
-	if (lw->stream_state == STREAM_OFF)
-		return -ENODEV;
-
-	if (list_empty(&lw->outqueue)) {
-		if (file->f_flags & O_NONBLOCK)
-			return -EAGAIN;
-		ret = wait_event_timeout(lw->wait_frame,
-					 !list_empty(&lw->outqueue),
-					 60*HZ/1000);
-		if (ret == 0)
-			ret = -ETIMEDOUT;
-		if (lw->stream_state == STREAM_OFF)
-			ret = -ENODEV;
-		if (ret < 0)
-			return ret;
-	}
-
-	spin_lock_irqsave(&lw->irq_lock, flags);
+	sp->parm.capture.capability = 0;
+	sp->parm.capture.capturemode = 0;
+	sp->parm.capture.extendedmode = 0;
+	sp->parm.capture.readbuffers = lw->queue.num_buffers;
 
-	frame = list_entry(lw->outqueue.next, struct logiwin_frame, frame);
-	list_del(lw->outqueue.next);
+	return 0;
+}
 
-	*b = frame->buf;
-	if (lw->flags & LOGIWIN_FLAG_BUFFERS_AVAILABLE) {
-		frame->state = FRAME_DEQUEUED;
+static int vidioc_enum_framesizes(struct file *file, void *fh,
+				  struct v4l2_frmsizeenum *fsize)
+{
+	struct logiwin *lw = video_drvdata(file);
 
-		if (atomic_read(&frame->vma_refcnt))
-			b->flags |= V4L2_BUF_FLAG_MAPPED;
-		b->flags |= V4L2_BUF_FLAG_DONE;
-		b->flags &= ~V4L2_BUF_FLAG_QUEUED;
-	} else if (lw->flags & (LOGIWIN_FLAG_BUFFERS_DESTROY |
-		   LOGIWIN_FLAG_BUFFERS_REALLOCATE)) {
-		frame->state = FRAME_UNUSED;
+	LW_DBG(INFO, "");
 
-		b->flags &= ~(V4L2_BUF_FLAG_MAPPED | V4L2_BUF_FLAG_QUEUED);
-	}
+	if ((fsize->index != 0) ||
+	    (fsize->pixel_format != lw->pix_format.pixelformat))
+		return -EINVAL;
 
-	spin_unlock_irqrestore(&lw->irq_lock, flags);
+	fsize->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+	fsize->discrete.width = lw->video_norm.width;
+	fsize->discrete.height = lw->video_norm.height;
 
 	return 0;
 }
@@ -986,7 +1693,7 @@ static int vidioc_dqbuf(struct file *file, void *fh, struct v4l2_buffer *b)
 static int vidioc_cropcap(struct file *file, void *fh,
 			  struct v4l2_cropcap *cropcap)
 {
-	struct logiwin *lw = fh;
+	struct logiwin *lw = video_drvdata(file);
 
 	LW_DBG(INFO, "");
 
@@ -1011,7 +1718,7 @@ static int vidioc_cropcap(struct file *file, void *fh,
 
 static int vidioc_g_crop(struct file *file, void *fh, struct v4l2_crop *crop)
 {
-	struct logiwin *lw = fh;
+	struct logiwin *lw = video_drvdata(file);
 
 	LW_DBG(INFO, "");
 
@@ -1026,37 +1733,52 @@ static int vidioc_g_crop(struct file *file, void *fh, struct v4l2_crop *crop)
 static int vidioc_s_crop(struct file *file, void *fh,
 			 const struct v4l2_crop *crop)
 {
-	struct logiwin *lw = fh;
+	struct logiwin *lw = video_drvdata(file);
 	const struct v4l2_rect *c = &crop->c;
+	struct logiwin_parameters lw_par;
+	unsigned long flags;
+	int ret = 0;
 
 	LW_DBG(INFO, "");
 
 	if (crop->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
 		return -EINVAL;
 
-	logiwin_set_rect_parameters(&lw->lw_par,
+	mutex_lock(&lw->ioctl_lock);
+
+	spin_lock_irqsave(&lw->irq_lock, flags);
+	lw_par = lw->lw_par;
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
+	lw_par.hw_access = false;
+
+	logiwin_set_rect_parameters(&lw_par,
 				    c->left, c->top, c->width, c->height,
 				    LOGIWIN_RECTANGLE_CROP);
 
-	if (logiwin_set_scale(&lw->lw_par))
-		return -EINVAL;
+	if (logiwin_set_scale(&lw_par)) {
+		ret = -EINVAL;
+		goto error_unlock;
+	}
 
-	lw->flags |= LOGIWIN_FLAG_UPDATE_REGISTERS;
+	spin_lock_irqsave(&lw->irq_lock, flags);
+	logiwin_copy_geometry(lw, &lw_par);
+	logiwin_stage(lw);
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
 
-	logiwin_get_rect_parameters(&lw->lw_par,
+	logiwin_get_rect_parameters(&lw_par,
 				    &lw->crop.left, &lw->crop.top,
 				    &lw->crop.width, &lw->crop.height,
 				    LOGIWIN_RECTANGLE_CROP);
 
-	if (lw->flags & LOGIWIN_FLAG_HW_BUFFER_SWITCH)
-		tasklet_schedule(&lw->tasklet);
+error_unlock:
+	mutex_unlock(&lw->ioctl_lock);
 
-	return 0;
+	return ret;
 }
 
 static int vidioc_overlay(struct file *file, void *fh, unsigned int on)
 {
-	struct logiwin *lw = fh;
+	struct logiwin *lw = video_drvdata(file);
 
 	LW_DBG(INFO, "");
 
@@ -1068,8 +1790,7 @@ static int vidioc_overlay(struct file *file, void *fh, unsigned int on)
 
 		logiwin_release_overlay_buffers(lw);
 	} else if (on == 1) {
-		if (lw->frames != LOGIWIN_DMA_BUFFERS ||
-		    lw->overlay.address[0].pa == 0)
+		if (lw->overlay.address[0].pa == 0)
 			return -ENOMEM;
 
 		if (lw->stream_state != STREAM_OFF)
@@ -1086,7 +1807,7 @@ static int vidioc_overlay(struct file *file, void *fh, unsigned int on)
 static int vidioc_g_fbuf(struct file *file, void *fh,
 			 struct v4l2_framebuffer *fb)
 {
-	struct logiwin *lw = fh;
+	struct logiwin *lw = video_drvdata(file);
 
 	LW_DBG(INFO, "");
 
@@ -1113,7 +1834,7 @@ static int vidioc_g_fbuf(struct file *file, void *fh,
 static int vidioc_s_fbuf(struct file *file, void *fh,
 			 const struct v4l2_framebuffer *fb)
 {
-	struct logiwin *lw = fh;
+	struct logiwin *lw = video_drvdata(file);
 	int i;
 
 	LW_DBG(INFO, "");
@@ -1127,9 +1848,7 @@ static int vidioc_s_fbuf(struct file *file, void *fh,
 	if (lw->stream_state != STREAM_OFF)
 		return -EBUSY;
 
-	lw->frames = LOGIWIN_DMA_BUFFERS;
-
-	for (i = 0; i < lw->frames; i++)
+	for (i = 0; i < LOGIWIN_DMA_BUFFERS; i++)
 		lw->overlay.address[i].pa =
 			(dma_addr_t)(fb->base + (i * fb->fmt.sizeimage));
 
@@ -1139,48 +1858,524 @@ static int vidioc_s_fbuf(struct file *file, void *fh,
 	return 0;
 }
 
-static int vidioc_streamon(struct file *file, void *fh, enum v4l2_buf_type type)
+static int logiwin_sync_buffer(struct logiwin *lw,
+			       struct logiwin_buffer_sync *sync)
+{
+	struct vb2_buffer *vb;
+	struct v4l2_rect *r = &sync->rect;
+	unsigned int bpl = lw->pix_format.bytesperline;
+	unsigned int bpp = lw->lw_hw.bpp / 8;
+	unsigned long offset, size;
+	dma_addr_t pa;
+	int i, ret = 0;
+
+	LW_DBG(INFO, "");
+
+	if (lw->cache_mode != LOGIWIN_CACHE_CACHED)
+		return 0;
+
+	if ((r->left < 0) || (r->top < 0) ||
+	    (r->width <= 0) || (r->height <= 0) ||
+	    (r->left >= bpl / bpp) || (r->width > bpl / bpp - r->left) ||
+	    (r->top >= lw->pix_format.height) ||
+	    (r->height > lw->pix_format.height - r->top))
+		return -EINVAL;
+
+	mutex_lock(&lw->queue_lock);
+
+	if (sync->index >= lw->queue.num_buffers) {
+		ret = -EINVAL;
+		goto error_unlock;
+	}
+
+	vb = lw->queue.bufs[sync->index];
+	if (vb->state != VB2_BUF_STATE_DEQUEUED) {
+		ret = -EBUSY;
+		goto error_unlock;
+	}
+
+	pa = vb2_dma_contig_plane_dma_addr(vb, 0);
+	offset = (r->top * bpl) + (r->left * bpp);
+	size = r->width * bpp;
+
+	/* buffer may be smaller than the format when allocated for another */
+	if (offset + ((r->height - 1) * bpl) + size >
+	    vb2_plane_size(vb, 0)) {
+		ret = -EINVAL;
+		goto error_unlock;
+	}
+
+	/* full stride lines are invalidated at once */
+	if (size == bpl) {
+		dma_sync_single_range_for_cpu(lw->dev, pa, offset,
+					      size * r->height,
+					      DMA_FROM_DEVICE);
+	} else {
+		for (i = 0; i < r->height; i++, offset += bpl)
+			dma_sync_single_range_for_cpu(lw->dev, pa, offset,
+						      size, DMA_FROM_DEVICE);
+	}
+
+error_unlock:
+	mutex_unlock(&lw->queue_lock);
+
+	return ret;
+}
+
+static int vidioc_subscribe_event(struct v4l2_fh *fh,
+				  const struct v4l2_event_subscription *sub)
+{
+	LW_DBG(INFO, "");
+
+	switch (sub->type) {
+	case V4L2_EVENT_SOURCE_CHANGE:
+		return v4l2_src_change_event_subscribe(fh, sub);
+	case V4L2_EVENT_FRAME_SYNC:
+		return v4l2_event_subscribe(fh, sub, 2, NULL);
+	case LOGIWIN_EVENT_COMMIT:
+		return v4l2_event_subscribe(fh, sub, 4, NULL);
+	case LOGIWIN_EVENT_ROI:
+		/* one event for each buffer that can wait for VIDIOC_DQBUF */
+		return v4l2_event_subscribe(fh, sub, LOGIWIN_MAX_BUFFERS,
+					    NULL);
+	default:
+		return -EINVAL;
+	}
+}
+
+static int logiwin_config_buffer(struct logiwin *lw,
+				 struct logiwin_buffer_config *cfg)
 {
-	struct logiwin *lw = fh;
+	struct logiwin_parameters lw_par;
+	struct logiwin_frame *frame;
+	struct vb2_buffer *vb;
+	struct v4l2_rect *c = &cfg->crop;
+	unsigned long flags;
+	int ret = 0;
 
 	LW_DBG(INFO, "");
 
-	if (type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+	if (cfg->flags & ~LOGIWIN_BUFFER_CONFIG_ALL)
+		return -EINVAL;
+	if ((cfg->flags & LOGIWIN_BUFFER_CONFIG_CROP) &&
+	    ((c->left < 0) || (c->top < 0) ||
+	     (c->width <= 0) || (c->height <= 0)))
+		return -EINVAL;
+	if ((cfg->flags & LOGIWIN_BUFFER_CONFIG_OUT) &&
+	    ((cfg->width == 0) || (cfg->height == 0) ||
+	     (cfg->width > lw->pix_format.width) ||
+	     (cfg->height > lw->pix_format.height)))
 		return -EINVAL;
 
-	if (!(lw->flags & LOGIWIN_FLAG_BUFFERS_AVAILABLE) ||
-	    lw->frames_queue == 0)
-		return -ENOMEM;
+	mutex_lock(&lw->queue_lock);
 
-	if (lw->stream_state != STREAM_OFF)
-		return -EBUSY;
+	if (cfg->index >= lw->queue.num_buffers) {
+		ret = -EINVAL;
+		goto error_unlock;
+	}
 
-	logiwin_enable(lw, CAPTURE_STREAM_ON);
+	vb = lw->queue.bufs[cfg->index];
+	if (vb->state != VB2_BUF_STATE_DEQUEUED) {
+		ret = -EBUSY;
+		goto error_unlock;
+	}
+
+	/* output is written into this buffer, whatever the format is later */
+	if ((cfg->flags & LOGIWIN_BUFFER_CONFIG_OUT) &&
+	    ((unsigned long)cfg->height * lw->pix_format.bytesperline >
+	     vb2_plane_size(vb, 0))) {
+		ret = -EINVAL;
+		goto error_unlock;
+	}
+
+	frame = to_logiwin_frame(vb);
+	frame->config = false;
+	if (!cfg->flags)
+		goto error_unlock;
+
+	/*
+	 * settings are prepared on a copy of device parameters, registers not
+	 * set for the buffer are restaged from them, not from the live shadow
+	 */
+	spin_lock_irqsave(&lw->irq_lock, flags);
+	lw_par = lw->lw_par;
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
+
+	lw_par.hw_access = false;
+
+	if (cfg->flags & LOGIWIN_BUFFER_CONFIG_CROP)
+		logiwin_set_rect_parameters(&lw_par, c->left, c->top,
+					    c->width, c->height,
+					    LOGIWIN_RECTANGLE_CROP);
+	if (cfg->flags & LOGIWIN_BUFFER_CONFIG_OUT)
+		logiwin_set_rect_parameters(&lw_par, 0, 0,
+					    cfg->width, cfg->height,
+					    LOGIWIN_RECTANGLE_OUT);
+	if ((cfg->flags & (LOGIWIN_BUFFER_CONFIG_CROP |
+			   LOGIWIN_BUFFER_CONFIG_OUT)) &&
+	    logiwin_set_scale(&lw_par)) {
+		ret = -EINVAL;
+		goto error_unlock;
+	}
+	if (cfg->flags & LOGIWIN_BUFFER_CONFIG_COLOR) {
+		logiwin_set_brightness(&lw_par, cfg->brightness);
+		logiwin_set_contrast(&lw_par, cfg->contrast);
+		logiwin_set_saturation(&lw_par, cfg->saturation);
+		logiwin_set_hue(&lw_par, cfg->hue);
+	}
+
+	logiwin_stage_registers(&lw_par);
+
+	memcpy(frame->shadow, lw_par.shadow, sizeof(frame->shadow));
+	frame->config = true;
+
+error_unlock:
+	mutex_unlock(&lw->queue_lock);
+
+	return ret;
+}
+
+static int logiwin_set_roi(struct logiwin *lw, struct logiwin_roi_list *list)
+{
+	u32 shadow[LOGIWIN_MAX_ROI][LOGIWIN_SHADOW_REGS];
+	struct logiwin_parameters lw_par;
+	struct v4l2_rect *c, *o;
+	unsigned long flags;
+	int i;
+
+	LW_DBG(INFO, "");
+
+	if (list->count > LOGIWIN_MAX_ROI)
+		return -EINVAL;
+
+	for (i = 0; i < list->count; i++) {
+		c = &list->roi[i].crop;
+		o = &list->roi[i].out;
+		if ((c->left < 0) || (c->top < 0) ||
+		    (c->width <= 0) || (c->height <= 0) ||
+		    (o->left < 0) || (o->top < 0) ||
+		    (o->width <= 0) || (o->height <= 0) ||
+		    (o->left + o->width > lw->pix_format.width) ||
+		    (o->top + o->height > lw->pix_format.height))
+			return -EINVAL;
+	}
+
+	if (!list->count) {
+		spin_lock_irqsave(&lw->irq_lock, flags);
+		lw->roi_count = 0;
+		spin_unlock_irqrestore(&lw->irq_lock, flags);
+		/* return to device crop and format at next frame start */
+		logiwin_stage_update(lw);
+		return 0;
+	}
+
+	spin_lock_irqsave(&lw->irq_lock, flags);
+	lw_par = lw->lw_par;
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
+
+	lw_par.hw_access = false;
+
+	for (i = 0; i < list->count; i++) {
+		c = &list->roi[i].crop;
+		o = &list->roi[i].out;
+
+		logiwin_set_rect_parameters(&lw_par, c->left, c->top,
+					    c->width, c->height,
+					    LOGIWIN_RECTANGLE_CROP);
+		logiwin_set_rect_parameters(&lw_par, o->left, o->top,
+					    o->width, o->height,
+					    LOGIWIN_RECTANGLE_OUT);
+		if (logiwin_set_scale(&lw_par))
+			return -EINVAL;
+
+		logiwin_stage_registers(&lw_par);
+		memcpy(shadow[i], lw_par.shadow, sizeof(shadow[i]));
+	}
+
+	/* regions in use are replaced only when all of them are valid */
+	spin_lock_irqsave(&lw->irq_lock, flags);
+	memcpy(lw->roi_shadow, shadow, list->count * sizeof(shadow[0]));
+	lw->roi_next = 0;
+	lw->roi_count = list->count;
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
 
 	return 0;
 }
 
-static int vidioc_streamoff(struct file *file, void *fh,
-			    enum v4l2_buf_type type)
+static int logiwin_set_animation(struct logiwin *lw,
+				 struct logiwin_animation *anim)
 {
-	struct logiwin *lw = fh;
+	struct logiwin_keyframe *key;
+	int i;
 
 	LW_DBG(INFO, "");
 
-	if (type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+	if ((anim->count > LOGIWIN_MAX_KEYFRAMES) ||
+	    (anim->flags & ~LOGIWIN_ANIMATION_ALL))
+		return -EINVAL;
+	if (anim->count && test_bit(LOGIWIN_FLAG_HW_BUFFER_SWITCH, &lw->flags))
 		return -EINVAL;
 
-	if (lw->stream_state != CAPTURE_STREAM_ON)
-		return -EBUSY;
+	for (i = 0; i < anim->count; i++) {
+		key = &anim->key[i];
+		if ((key->frames == 0) ||
+		    (key->frames > LOGIWIN_MAX_KEYFRAME_FRAMES) ||
+		    (key->alpha > 0xFF) ||
+		    (key->crop.left < 0) || (key->crop.top < 0) ||
+		    (key->crop.width <= 0) || (key->crop.height <= 0) ||
+		    (key->window.left < 0) || (key->window.top < 0) ||
+		    (key->window.width <= 0) || (key->window.height <= 0))
+			return -EINVAL;
+		if ((anim->flags & LOGIWIN_ANIMATION_WINDOW) &&
+		    (lw->stream_state != OVERLAY_STREAM_ON) &&
+		    ((key->window.left + key->window.width >
+		      lw->pix_format.width) ||
+		     (key->window.top + key->window.height >
+		      lw->pix_format.height)))
+			return -EINVAL;
+	}
+
+	lw->anim = *anim;
+	lw->anim_key = 0;
+	lw->anim_frame = 0;
+	lw->anim_active = (anim->count != 0);
+
+	return 0;
+}
+
+static int logiwin_interpolate(int from, int to, unsigned int t,
+			       unsigned int d)
+{
+	return from + (int)div_s64(((s64)to - from) * t, d);
+}
+
+static void logiwin_interpolate_rect(struct v4l2_rect *r,
+				     const struct v4l2_rect *from,
+				     const struct v4l2_rect *to,
+				     unsigned int t, unsigned int d)
+{
+	r->left = logiwin_interpolate(from->left, to->left, t, d);
+	r->top = logiwin_interpolate(from->top, to->top, t, d);
+	r->width = logiwin_interpolate(from->width, to->width, t, d);
+	r->height = logiwin_interpolate(from->height, to->height, t, d);
+}
+
+/*
+ * Calculate the next animation step and stage it to be committed at the
+ * next frame start. Called from the interrupt thread with ioctl_lock held.
+ */
+static void logiwin_animate(struct logiwin *lw)
+{
+	struct logiwin_animation *anim = &lw->anim;
+	struct logiwin_keyframe *from, *to;
+	struct logiwin_parameters lw_par;
+	struct v4l2_rect crop, window;
+	unsigned int next, alpha;
+	unsigned long flags;
+
+	LW_DBG(INFO, "");
+
+	next = lw->anim_key + 1;
+	if (next == anim->count)
+		next = (anim->flags & LOGIWIN_ANIMATION_LOOP) ?
+		       0 : lw->anim_key;
+
+	from = &anim->key[lw->anim_key];
+	to = &anim->key[next];
+
+	logiwin_interpolate_rect(&crop, &from->crop, &to->crop,
+				 lw->anim_frame, from->frames);
+	logiwin_interpolate_rect(&window, &from->window, &to->window,
+				 lw->anim_frame, from->frames);
+	alpha = logiwin_interpolate(from->alpha, to->alpha,
+				    lw->anim_frame, from->frames);
+
+	spin_lock_irqsave(&lw->irq_lock, flags);
+	lw_par = lw->lw_par;
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
+
+	lw_par.hw_access = false;
+
+	if (anim->flags & LOGIWIN_ANIMATION_CROP)
+		logiwin_set_rect_parameters(&lw_par, crop.left, crop.top,
+					    crop.width, crop.height,
+					    LOGIWIN_RECTANGLE_CROP);
+	if (anim->flags & LOGIWIN_ANIMATION_WINDOW)
+		logiwin_set_rect_parameters(&lw_par, window.left, window.top,
+					    window.width, window.height,
+					    LOGIWIN_RECTANGLE_OUT);
+	if ((anim->flags & (LOGIWIN_ANIMATION_CROP |
+			    LOGIWIN_ANIMATION_WINDOW)) &&
+	    logiwin_set_scale(&lw_par)) {
+		dev_err(lw->dev, "failed animation scale\n");
+		lw->anim_active = false;
+		return;
+	}
+
+	/*
+	 * Each step is taken over, so crop and window read back the values
+	 * in use and changes after the animation start from its last step.
+	 */
+	spin_lock_irqsave(&lw->irq_lock, flags);
+	logiwin_copy_geometry(lw, &lw_par);
+	if (anim->flags & LOGIWIN_ANIMATION_ALPHA) {
+		lw->alpha = alpha;
+		lw->alpha_pending = true;
+	}
+	logiwin_stage(lw);
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
+
+	logiwin_get_rect_parameters(&lw_par,
+				    &lw->crop.left, &lw->crop.top,
+				    &lw->crop.width, &lw->crop.height,
+				    LOGIWIN_RECTANGLE_CROP);
+	logiwin_get_rect_parameters(&lw_par,
+				    &lw->window.w.left, &lw->window.w.top,
+				    &lw->window.w.width, &lw->window.w.height,
+				    LOGIWIN_RECTANGLE_OUT);
+	if (anim->flags & LOGIWIN_ANIMATION_ALPHA)
+		lw->window.global_alpha = alpha;
+
+	/* last keyframe without loop is applied once */
+	if (next == lw->anim_key) {
+		lw->anim_active = false;
+		return;
+	}
+
+	if (++lw->anim_frame >= from->frames) {
+		lw->anim_frame = 0;
+		lw->anim_key = next;
+	}
+}
+
+static int logiwin_params_rect(struct logiwin_parameters *lw_par,
+			       struct logiwin_params *params)
+{
+	struct logiwin_param *p;
+	bool scale = false;
+	int i;
+
+	for (i = 0; i < params->count; i++) {
+		p = &params->param[i];
+		if (p->type == LOGIWIN_PARAM_CROP)
+			logiwin_set_rect_parameters(lw_par,
+						    p->u.rect.left,
+						    p->u.rect.top,
+						    p->u.rect.width,
+						    p->u.rect.height,
+						    LOGIWIN_RECTANGLE_CROP);
+		else if (p->type == LOGIWIN_PARAM_WINDOW)
+			logiwin_set_rect_parameters(lw_par,
+						    p->u.rect.left,
+						    p->u.rect.top,
+						    p->u.rect.width,
+						    p->u.rect.height,
+						    LOGIWIN_RECTANGLE_OUT);
+		else
+			continue;
+		scale = true;
+	}
+
+	if (scale && logiwin_set_scale(lw_par))
+		return -EINVAL;
+
+	return 0;
+}
+
+static int logiwin_set_params(struct logiwin *lw,
+			      struct logiwin_params *params)
+{
+	struct logiwin_parameters lw_par;
+	struct logiwin_param *p;
+	struct v4l2_rect *r;
+	unsigned long flags;
+	u32 ctrl, set, clear;
+	int i, alpha = -1;
+
+	LW_DBG(INFO, "");
 
-	logiwin_disable(lw);
+	if (params->count > LOGIWIN_MAX_PARAMS)
+		return -EINVAL;
+
+	for (i = 0; i < params->count; i++) {
+		p = &params->param[i];
+		r = &p->u.rect;
+		switch (p->type) {
+		case LOGIWIN_PARAM_WINDOW:
+			if ((lw->stream_state != OVERLAY_STREAM_ON) &&
+			    ((r->left + r->width > lw->pix_format.width) ||
+			     (r->top + r->height > lw->pix_format.height)))
+				return -EINVAL;
+			/* fall through */
+		case LOGIWIN_PARAM_CROP:
+			if ((r->left < 0) || (r->top < 0) ||
+			    (r->width <= 0) || (r->height <= 0))
+				return -EINVAL;
+			break;
+		case LOGIWIN_PARAM_ALPHA:
+			if (p->u.value > 0xFF)
+				return -EINVAL;
+			alpha = p->u.value;
+			break;
+		case LOGIWIN_PARAM_SYNC_POLARITY:
+		case LOGIWIN_PARAM_SWIZZLE:
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	/* validate all parameters together on a copy */
+	spin_lock_irqsave(&lw->irq_lock, flags);
+	lw_par = lw->lw_par;
+	ctrl = lw_par.ctrl;
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
+
+	lw_par.hw_access = false;
+
+	if (logiwin_params_rect(&lw_par, params))
+		return -EINVAL;
+
+	for (i = 0; i < params->count; i++) {
+		p = &params->param[i];
+		if (p->type == LOGIWIN_PARAM_SYNC_POLARITY)
+			logiwin_sync_polarity(&lw_par, lw_par.channel_id,
+					      p->u.value &
+					      V4L2_DV_HSYNC_POS_POL,
+					      p->u.value &
+					      V4L2_DV_VSYNC_POS_POL);
+		else if (p->type == LOGIWIN_PARAM_SWIZZLE)
+			logiwin_operation(&lw_par, LOGIWIN_OP_SWIZZLE,
+					  p->u.value ?
+					  LOGIWIN_OP_FLAG_ENABLE :
+					  LOGIWIN_OP_FLAG_DISABLE);
+	}
+	set = lw_par.ctrl & ~ctrl;
+	clear = ctrl & ~lw_par.ctrl;
 
-	logiwin_empty_queues(lw);
+	logiwin_get_rect_parameters(&lw_par,
+				    &lw->crop.left, &lw->crop.top,
+				    &lw->crop.width, &lw->crop.height,
+				    LOGIWIN_RECTANGLE_CROP);
+	logiwin_get_rect_parameters(&lw_par,
+				    &lw->window.w.left, &lw->window.w.top,
+				    &lw->window.w.width, &lw->window.w.height,
+				    LOGIWIN_RECTANGLE_OUT);
 
-	if (lw->flags & LOGIWIN_FLAG_BUFFERS_DESTROY) {
-		logiwin_release_buffers(lw);
-		lw->flags &= ~LOGIWIN_FLAG_BUFFERS_DESTROY;
+	spin_lock_irqsave(&lw->irq_lock, flags);
+
+	logiwin_copy_geometry(lw, &lw_par);
+	lw->ctrl_set = (lw->ctrl_set & ~clear) | set;
+	lw->ctrl_clear = (lw->ctrl_clear & ~set) | clear;
+	if (alpha >= 0) {
+		lw->alpha = alpha;
+		lw->alpha_pending = true;
 	}
+	logiwin_stage(lw);
+
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
+
+	logiwin_ctrl_restart(lw);
 
 	return 0;
 }
@@ -1188,13 +2383,15 @@ static int vidioc_streamoff(struct file *file, void *fh,
 static long logiwin_ioctl(struct file *file, void *fh, bool valid_prio,
 			  unsigned int cmd, void *arg)
 {
-	struct logiwin *lw = fh;
+	struct logiwin *lw = video_drvdata(file);
+	unsigned long flags;
 	int ret = 0;
 	unsigned int id;
 	union locked_ioctl {
 		u32 alpha;
 		u32 sync_pol;
 		bool enable;
+		struct logiwin_params params;
 	} lio;
 
 	LW_DBG(INFO, "");
@@ -1229,9 +2426,9 @@ static long logiwin_ioctl(struct file *file, void *fh, bool valid_prio,
 		atomic_inc(&lw->wait_resolution_refcnt);
 
 		ret = wait_event_interruptible(lw->wait_resolution,
-					       (lw->flags &
-					       LOGIWIN_FLAG_RESOLUTION));
-		lw->flags &= ~LOGIWIN_FLAG_RESOLUTION;
+					       test_bit(LOGIWIN_FLAG_RESOLUTION,
+							&lw->flags));
+		clear_bit(LOGIWIN_FLAG_RESOLUTION, &lw->flags);
 
 		atomic_dec(&lw->wait_resolution_refcnt);
 		break;
@@ -1240,9 +2437,11 @@ static long logiwin_ioctl(struct file *file, void *fh, bool valid_prio,
 		mutex_lock(&lw->ioctl_lock);
 		lio.enable = *((bool *)arg);
 		if (lio.enable)
-			lw->flags |= LOGIWIN_FLAG_OVERLAY_BUFFER_SWITCH;
+			set_bit(LOGIWIN_FLAG_OVERLAY_BUFFER_SWITCH,
+				&lw->flags);
 		else
-			lw->flags &= ~LOGIWIN_FLAG_OVERLAY_BUFFER_SWITCH;
+			clear_bit(LOGIWIN_FLAG_OVERLAY_BUFFER_SWITCH,
+				  &lw->flags);
 		mutex_unlock(&lw->ioctl_lock);
 		break;
 
@@ -1251,24 +2450,25 @@ static long logiwin_ioctl(struct file *file, void *fh, bool valid_prio,
 		break;
 
 	case LOGIWIN_IOCTL_SWIZZLE:
+		/* switched at the next frame start, see LOGIWIN_IOCTL_CONFIG */
+		memset(&lio.params, 0, sizeof(lio.params));
+		lio.params.count = 1;
+		lio.params.param[0].type = LOGIWIN_PARAM_SWIZZLE;
+		lio.params.param[0].u.value = *((bool *)arg);
 		mutex_lock(&lw->ioctl_lock);
-		lio.enable = *((bool *)arg);
-		if (lio.enable)
-			logiwin_operation(&lw->lw_par, LOGIWIN_OP_SWIZZLE,
-					  LOGIWIN_OP_FLAG_ENABLE);
-		else
-			logiwin_operation(&lw->lw_par, LOGIWIN_OP_SWIZZLE,
-					  LOGIWIN_OP_FLAG_DISABLE);
+		ret = logiwin_set_params(lw, &lio.params);
 		mutex_unlock(&lw->ioctl_lock);
 		break;
 
 	case LOGIWIN_IOCTL_SYNC_POLARITY:
 		mutex_lock(&lw->ioctl_lock);
 		lio.sync_pol = *((u32 *)arg);
+		spin_lock_irqsave(&lw->irq_lock, flags);
 		logiwin_sync_polarity(&lw->lw_par,
 				      lw->lw_par.channel_id,
 				      lio.sync_pol & V4L2_DV_HSYNC_POS_POL,
 				      lio.sync_pol & V4L2_DV_VSYNC_POS_POL);
+		spin_unlock_irqrestore(&lw->irq_lock, flags);
 		mutex_unlock(&lw->ioctl_lock);
 		break;
 
@@ -1284,8 +2484,43 @@ static long logiwin_ioctl(struct file *file, void *fh, bool valid_prio,
 		break;
 
 	case LOGIWIN_IOCTL_FRAME_PHYS_ADDRESS:
-		*((unsigned long *)arg) =
-			lw->capture.address[lw->capture.id].pa;
+		spin_lock_irqsave(&lw->irq_lock, flags);
+		if (lw->active)
+			*((unsigned long *)arg) =
+				vb2_dma_contig_plane_dma_addr(&lw->active->vb,
+							      0);
+		else
+			ret = -ENODEV;
+		spin_unlock_irqrestore(&lw->irq_lock, flags);
+		break;
+
+	case LOGIWIN_IOCTL_BUFFER_SYNC:
+		ret = logiwin_sync_buffer(lw,
+					  (struct logiwin_buffer_sync *)arg);
+		break;
+
+	case LOGIWIN_IOCTL_BUFFER_CONFIG:
+		ret = logiwin_config_buffer(lw,
+					    (struct logiwin_buffer_config *)arg);
+		break;
+
+	case LOGIWIN_IOCTL_ROI:
+		mutex_lock(&lw->ioctl_lock);
+		ret = logiwin_set_roi(lw, (struct logiwin_roi_list *)arg);
+		mutex_unlock(&lw->ioctl_lock);
+		break;
+
+	case LOGIWIN_IOCTL_CONFIG:
+		mutex_lock(&lw->ioctl_lock);
+		ret = logiwin_set_params(lw, (struct logiwin_params *)arg);
+		mutex_unlock(&lw->ioctl_lock);
+		break;
+
+	case LOGIWIN_IOCTL_ANIMATION:
+		mutex_lock(&lw->ioctl_lock);
+		ret = logiwin_set_animation(lw,
+					    (struct logiwin_animation *)arg);
+		mutex_unlock(&lw->ioctl_lock);
 		break;
 
 	default:
@@ -1316,18 +2551,23 @@ static const struct v4l2_ioctl_ops logiwin_ioctl_ops = {
 	.vidioc_s_input = vidioc_s_input,
 	.vidioc_g_parm = vidioc_g_parm,
 	.vidioc_enum_framesizes = vidioc_enum_framesizes,
-	.vidioc_reqbufs = vidioc_reqbufs,
-	.vidioc_querybuf = vidioc_querybuf,
-	.vidioc_qbuf = vidioc_qbuf,
-	.vidioc_dqbuf = vidioc_dqbuf,
+	.vidioc_reqbufs = vb2_ioctl_reqbufs,
+	.vidioc_create_bufs = vb2_ioctl_create_bufs,
+	.vidioc_prepare_buf = vb2_ioctl_prepare_buf,
+	.vidioc_querybuf = vb2_ioctl_querybuf,
+	.vidioc_qbuf = vb2_ioctl_qbuf,
+	.vidioc_dqbuf = vb2_ioctl_dqbuf,
+	.vidioc_expbuf = vb2_ioctl_expbuf,
 	.vidioc_cropcap = vidioc_cropcap,
 	.vidioc_g_crop = vidioc_g_crop,
 	.vidioc_s_crop = vidioc_s_crop,
 	.vidioc_overlay = vidioc_overlay,
 	.vidioc_g_fbuf = vidioc_g_fbuf,
 	.vidioc_s_fbuf = vidioc_s_fbuf,
-	.vidioc_streamon = vidioc_streamon,
-	.vidioc_streamoff = vidioc_streamoff,
+	.vidioc_streamon = vb2_ioctl_streamon,
+	.vidioc_streamoff = vb2_ioctl_streamoff,
+	.vidioc_subscribe_event = vidioc_subscribe_event,
+	.vidioc_unsubscribe_event = v4l2_event_unsubscribe,
 	.vidioc_default = logiwin_ioctl
 };
 
@@ -1369,6 +2609,8 @@ static void logiwin_init_params(struct logiwin *lw)
 
 	lw->lw_par.int_mask = 0xFFFF;
 
+	lw->lw_par.shadow_dirty = LOGIWIN_SHADOW_ALL;
+
 	lw->lw_par.input_format = lw->lw_cfg.input_format;
 
 	lw->lw_par.brightness = 0;
@@ -1377,7 +2619,9 @@ static void logiwin_init_params(struct logiwin *lw)
 	lw->lw_par.hue = 0;
 
 	if (lw->lw_cfg.hw_buff_switch)
-		lw->flags |= LOGIWIN_FLAG_HW_BUFFER_SWITCH;
+		set_bit(LOGIWIN_FLAG_HW_BUFFER_SWITCH, &lw->flags);
+	else if (lw->lw_cfg.cpu_buff_switch)
+		set_bit(LOGIWIN_FLAG_CPU_BUFFER_SWITCH, &lw->flags);
 
 	logiwin_set_video_norm(&lw->video_norm,
 			       lw->lw_par.out_hres, lw->lw_par.out_vres);
@@ -1399,25 +2643,28 @@ static int logiwin_startup_config(struct logiwin *lw, bool weave_deinterlace)
 	if (logiwin_set_scale(&lw->lw_par))
 		return -EINVAL;
 
-	lw->flags &= ~LOGIWIN_FLAG_UPDATE_REGISTERS;
-	lw->flags |= LOGIWIN_FLAG_DEVICE_IN_USE;
+	clear_bit(LOGIWIN_FLAG_UPDATE_REGISTERS, &lw->flags);
 
 	return 0;
 }
 
 static int logiwin_open(struct file *file)
 {
-	struct video_device *vdev = video_devdata(file);
-	struct logiwin *lw = video_get_drvdata(vdev);
+	struct logiwin *lw = video_drvdata(file);
 	int ret;
 
 	LW_DBG(INFO, "");
 
-	if (lw->flags & LOGIWIN_FLAG_DEVICE_IN_USE)
-		return -EBUSY;
-
 	mutex_lock(&lw->fops_lock);
 
+	ret = v4l2_fh_open(file);
+	if (ret)
+		goto error_unlock;
+
+	/* device is configured by the first opened file handle only */
+	if (!v4l2_fh_is_singular_file(file))
+		goto error_unlock;
+
 	lw->pix_format.width = lw->video_norm.width;
 	lw->pix_format.height = lw->video_norm.height;
 	lw->pix_format.pixelformat = lw->lw_cfg.output_format;
@@ -1429,7 +2676,13 @@ static int logiwin_open(struct file *file)
 	lw->pix_format.colorspace = V4L2_COLORSPACE_SRGB;
 	lw->pix_format.priv = 0;
 
+	mutex_lock(&lw->ioctl_lock);
 	ret = logiwin_startup_config(lw, false);
+	mutex_unlock(&lw->ioctl_lock);
+	if (ret) {
+		v4l2_fh_release(file);
+		goto error_unlock;
+	}
 
 	memcpy(&lw->cropcap.bounds, &lw->lw_par.bounds,
 	       sizeof(struct v4l2_rect));
@@ -1444,8 +2697,7 @@ static int logiwin_open(struct file *file)
 	lw->window.field = V4L2_FIELD_NONE;
 	lw->window.global_alpha = lw->lw_par.alpha;
 
-	file->private_data = lw;
-
+error_unlock:
 	mutex_unlock(&lw->fops_lock);
 
 	return ret;
@@ -1453,104 +2705,56 @@ static int logiwin_open(struct file *file)
 
 static int logiwin_close(struct file *file)
 {
-	struct logiwin *lw = file->private_data;
+	struct logiwin *lw = video_drvdata(file);
+	unsigned long flags;
 
 	LW_DBG(INFO, "");
 
 	mutex_lock(&lw->fops_lock);
 
-	if (lw->stream_state != STREAM_OFF)
-		logiwin_disable(lw);
-
-	if (lw->flags & LOGIWIN_FLAG_BUFFERS_AVAILABLE) {
-		mdelay(HZ / 10);
-		logiwin_release_buffers(lw);
+	mutex_lock(&lw->queue_lock);
+	if (file->private_data == lw->queue.owner) {
+		vb2_queue_release(&lw->queue);
+		lw->queue.owner = NULL;
 	}
-	lw->flags &= ~LOGIWIN_FLAG_DEVICE_IN_USE;
-
-	lw->lw_par.hw_access = false;
-
-	mutex_unlock(&lw->fops_lock);
-
-	return 0;
-}
-
-static void logiwin_vm_open(struct vm_area_struct *vma)
-{
-	struct logiwin_frame *frame = vma->vm_private_data;
-
-	LW_DBG(INFO, "");
-
-	atomic_inc(&frame->vma_refcnt);
-}
-
-static void logiwin_vm_close(struct vm_area_struct *vma)
-{
-	struct logiwin_frame *frame = vma->vm_private_data;
-
-	LW_DBG(INFO, "");
-
-	atomic_dec(&frame->vma_refcnt);
-}
-
-static struct vm_operations_struct logiwin_vm_ops = {
-	.open = logiwin_vm_open,
-	.close = logiwin_vm_close,
-};
-
-static int logiwin_mmap(struct file *file, struct vm_area_struct *vma)
-{
-	struct logiwin *lw = file->private_data;
-	unsigned long vm_flags = VM_WRITE | VM_SHARED;
-	unsigned long size;
-	int ret = -EINVAL;
-	int i;
-
-	LW_DBG(INFO, "");
-
-	if (!(lw->flags & LOGIWIN_FLAG_BUFFERS_AVAILABLE))
-		return -ENOMEM;
+	mutex_unlock(&lw->queue_lock);
 
-	if (mutex_lock_interruptible(&lw->fops_lock))
-		return -ERESTARTSYS;
-
-	size = vma->vm_end - vma->vm_start;
-	if (size != PAGE_ALIGN(lw->frame[0].buf.length)) {
-		dev_err(lw->dev, "failed size page align\n");
-		goto error_unlock;
-	}
+	if (v4l2_fh_is_singular_file(file)) {
+		if (lw->stream_state == OVERLAY_STREAM_ON) {
+			logiwin_disable(lw);
+			logiwin_release_overlay_buffers(lw);
+		}
 
-	for (i = 0; i < lw->frames; i++)
-		if ((lw->frame[i].buf.m.offset >> PAGE_SHIFT) == vma->vm_pgoff)
-			break;
+		mutex_lock(&lw->ioctl_lock);
 
-	if (i == lw->frames) {
-		dev_err(lw->dev, "invalid mapping address, out of range\n");
-		goto error_unlock;
-	}
+		/* regions, animation and staged settings end with the user */
+		spin_lock_irqsave(&lw->irq_lock, flags);
+		lw->roi_count = 0;
+		lw->roi_next = 0;
+		memset(&lw->anim, 0, sizeof(lw->anim));
+		lw->anim_key = 0;
+		lw->anim_frame = 0;
+		lw->anim_active = false;
+		lw->alpha_pending = false;
+		lw->ctrl_set = 0;
+		lw->ctrl_clear = 0;
+		spin_unlock_irqrestore(&lw->irq_lock, flags);
 
-	if ((vma->vm_flags & vm_flags) != vm_flags) {
-		dev_err(lw->dev, "failed mapping protection\n");
-		goto error_unlock;
-	}
+		/* next open starts in progressive frame mode */
+		clear_bit(LOGIWIN_FLAG_DEINTERLACE, &lw->flags);
+		logiwin_set_weave(lw, false);
+		logiwin_stage_operation(lw, LOGIWIN_OP_EVEN_FIELD_VBUFF_SWITCH,
+					false);
 
-	ret = remap_pfn_range(vma, vma->vm_start,
-			      (lw->frame[i].buff_addr >> PAGE_SHIFT),
-			      size, vma->vm_page_prot);
-	if (ret) {
-		dev_err(lw->dev, "failed address mapping \n");
-		goto error_unlock;
+		lw->lw_par.hw_access = false;
+		mutex_unlock(&lw->ioctl_lock);
 	}
 
-	vma->vm_ops = &logiwin_vm_ops;
-	vma->vm_private_data = &lw->frame[i];
+	v4l2_fh_release(file);
 
-	logiwin_vm_open(vma);
-
-error_unlock:
 	mutex_unlock(&lw->fops_lock);
 
-	return ret;
+	return 0;
 }
 
 static const struct v4l2_file_operations logiwin_fops = {
@@ -1558,7 +2762,8 @@ static const struct v4l2_file_operations logiwin_fops = {
 	.open = logiwin_open,
 	.release = logiwin_close,
 	.unlocked_ioctl = video_ioctl2,
-	.mmap = logiwin_mmap,
+	.mmap = vb2_fop_mmap,
+	.poll = vb2_fop_poll,
 };
 
 static const struct video_device logiwin_template = {
@@ -1569,102 +2774,512 @@ static const struct video_device logiwin_template = {
 	.minor = -1
 };
 
-static void logiwin_tasklet(unsigned long arg)
+static irqreturn_t logiwin_irq_thread(int irq, void *pdev)
 {
-	struct logiwin *lw = (struct logiwin *)arg;
+	struct logiwin *lw = (struct logiwin *)pdev;
+	struct sched_param param = {
+		.sched_priority = clamp_t(unsigned int, irq_priority,
+					  1, MAX_USER_RT_PRIO - 2)
+	};
 
 	LW_DBG(INFO, "");
 
-	if (lw->flags & LOGIWIN_FLAG_UPDATE_REGISTERS) {
-		logiwin_update(lw);
-		lw->flags &= ~LOGIWIN_FLAG_UPDATE_REGISTERS;
+	if (!lw->irq_thread_rt) {
+		if (sched_setscheduler(current, SCHED_FIFO, &param))
+			dev_err(lw->dev, "failed set irq thread priority\n");
+		lw->irq_thread_rt = true;
+	}
+
+	/*
+	 * Set again by the interrupt handler if a change comes meanwhile, or
+	 * here when ioctl lock is busy, to retry at the next frame start.
+	 */
+	if (test_and_clear_bit(LOGIWIN_FLAG_UPDATE_REGISTERS, &lw->flags) &&
+	    logiwin_update(lw))
+		set_bit(LOGIWIN_FLAG_UPDATE_REGISTERS, &lw->flags);
+
+	logiwin_ctrl_restart(lw);
+
+	/* a step skipped on busy ioctl lock is taken at the next frame */
+	if (test_and_clear_bit(LOGIWIN_FLAG_ANIM_STEP, &lw->flags) &&
+	    logiwin_thread_lock(lw)) {
+		if (lw->anim_active)
+			logiwin_animate(lw);
+		mutex_unlock(&lw->ioctl_lock);
+	}
+
+	return IRQ_HANDLED;
+}
+
+/*
+ * Count field start interrupts missed since the previous one. The interval
+ * is compared with the average field period, an interval much shorter
+ * than the average restarts it, so a first interval covering a missed
+ * field start does not hide the following ones.
+ */
+static void logiwin_field_interval(struct logiwin *lw, u64 interval)
+{
+	u64 period = lw->field_period;
+
+	if (!period || (interval < period - period / 3)) {
+		lw->field_period = interval;
+	} else if (interval > period + period / 2) {
+		lw->fields_missed += div64_u64(interval + period / 2,
+					       period) - 1;
+	} else {
+		lw->field_period = period - (period >> 3) + (interval >> 3);
+	}
+}
+
+/* Return captured buffer, called with irq_lock held */
+static void logiwin_frame_done(struct logiwin *lw, struct logiwin_frame *frame,
+			       enum vb2_buffer_state state)
+{
+	struct logiwin_event_roi *roi;
+	struct v4l2_event ev;
+	unsigned int field;
+	bool torn = false;
+
+	/* logiWIN was disabled for a mode switch while writing this frame */
+	if ((lw->torn_seq == lw->frame_seq) && (state == VB2_BUF_STATE_DONE)) {
+		state = VB2_BUF_STATE_ERROR;
+		torn = true;
+	}
+
+	frame->ts = lw->frame_ts;
+	frame->vb.v4l2_buf.timestamp = ns_to_timeval(frame->ts);
+	if (lw->pix_format.field == V4L2_FIELD_ALTERNATE) {
+		/*
+		 * Interrupts come at each field start. logiWIN does not
+		 * report the field it writes, the first field captured after
+		 * stream on is assumed to be the top field and parity is
+		 * counted from it, including missed field start interrupts,
+		 * so it is inverted only when that assumption fails. Both
+		 * fields of a frame have the same sequence number.
+		 */
+		field = lw->frame_seq - 1 + lw->fields_missed;
+		frame->vb.v4l2_buf.sequence = field / 2;
+		frame->vb.v4l2_buf.field = (field & 1) ?
+					   V4L2_FIELD_BOTTOM : V4L2_FIELD_TOP;
+	} else {
+		frame->vb.v4l2_buf.sequence = lw->frame_seq - 1;
+		frame->vb.v4l2_buf.field = lw->pix_format.field;
+	}
+	trace_logiwin_buf_done(lw->video_dev.minor, frame->vb.v4l2_buf.index,
+			       frame->vb.v4l2_buf.sequence, frame->ts);
+	if (frame->roi >= 0) {
+		memset(&ev, 0, sizeof(ev));
+		ev.type = LOGIWIN_EVENT_ROI;
+		roi = (struct logiwin_event_roi *)ev.u.data;
+		roi->index = frame->vb.v4l2_buf.index;
+		roi->sequence = frame->vb.v4l2_buf.sequence;
+		roi->roi = frame->roi;
+		v4l2_event_queue(&lw->video_dev, &ev);
 	}
+	vb2_buffer_done(&frame->vb, state);
+	if (state == VB2_BUF_STATE_DONE)
+		lw->stats.frames_captured++;
+	else if (!torn)
+		lw->stats.frames_late++;
 }
 
-static int logiwin_handle_buffer(struct logiwin *lw)
+static void logiwin_handle_buffer(struct logiwin *lw,
+				  struct logiwin_frame *next,
+				  enum vb2_buffer_state state)
 {
 	struct logiwin_frame *frame;
 	unsigned long flags;
-	int ret = -ENOMEM;
 
 	LW_DBG(INFO, "");
 
 	spin_lock_irqsave(&lw->irq_lock, flags);
 
-	if (!list_empty(&lw->inqueue)) {
-		frame = list_entry(lw->inqueue.next,
-				   struct logiwin_frame, frame);
+	frame = lw->active;
+	lw->active = next;
+	if (frame)
+		logiwin_frame_done(lw, frame, state);
 
-		do_gettimeofday(&frame->buf.timestamp);
-		frame->buf.bytesused = frame->buf.length;
-		frame->buf.sequence = lw->frame_seq;
-		frame->state = FRAME_DONE;
+	spin_unlock_irqrestore(&lw->irq_lock, flags);
+}
+
+/*
+ * Stop or resume storing frames, called at frame start. logiWIN is
+ * reenabled by the interrupt thread when the switch needs it.
+ */
+static void logiwin_store_stop(struct logiwin *lw, bool stop)
+{
+	LW_DBG(INFO, "");
 
-		list_move_tail(&frame->frame, &lw->outqueue);
+	spin_lock(&lw->irq_lock);
+	if (logiwin_frame_store_stop(&lw->lw_par, stop))
+		set_bit(LOGIWIN_FLAG_CTRL_RESTART, &lw->flags);
+	spin_unlock(&lw->irq_lock);
+}
 
-		lw->frames_queue--;
+/*
+ * With cpu-buffer-switch, logiWIN takes the buffer address requested in
+ * the previous frame at frame start, never in the middle of a frame. When
+ * the request was made too late and is still pending, the active buffer
+ * is written again and no buffer is returned.
+ */
+static void logiwin_cpu_buffer_switch(struct logiwin *lw, u64 ts)
+{
+	struct logiwin_frame *frame = NULL;
+	dma_addr_t pa;
 
-		wake_up(&lw->wait_frame);
+	LW_DBG(INFO, "");
 
-		ret = 0;
+	spin_lock(&lw->irq_lock);
+
+	if (lw->armed && !logiwin_buffer_switch_pending(&lw->lw_par)) {
+		frame = lw->active;
+		lw->active = lw->armed;
+		lw->armed = NULL;
+		if (frame)
+			logiwin_frame_done(lw, frame, VB2_BUF_STATE_DONE);
+	} else if (lw->active) {
+		lw->frames_skip++;
+		lw->stats.frames_skipped++;
 	}
 
-	spin_unlock_irqrestore(&lw->irq_lock, flags);
+	spin_unlock(&lw->irq_lock);
 
-	return ret;
+	/* settings of the buffer taken now apply from this frame */
+	if (frame || (lw->active && lw->frame_seq == 0))
+		logiwin_apply_buffer_config(lw, lw->active);
+
+	if (lw->armed)
+		return;
+
+	frame = logiwin_get_buf(lw);
+	if (!frame)
+		return;
+
+	trace_logiwin_get_buf(lw->video_dev.minor, frame->vb.v4l2_buf.index,
+			      lw->frame_seq, ts);
+	pa = vb2_dma_contig_plane_dma_addr(&frame->vb, 0);
+	logiwin_set_buffer(lw, pa);
+	logiwin_buffer_switch(&lw->lw_par);
+	lw->armed = frame;
+	logiwin_hist_add(lw->stats.irq_latency, ktime_get_ns() - ts);
 }
 
 static irqreturn_t logiwin_isr(int irq, void *pdev)
 {
+	u64 ts = ktime_get_ns();
 	struct logiwin *lw = (struct logiwin *)pdev;
 	u32 isr = logiwin_int_stat_get(&lw->lw_par);
-	struct logiwin_dma *address;
+	struct logiwin_frame *frame;
+	struct v4l2_event ev;
+	dma_addr_t pa;
 	unsigned int id;
-	bool next_buff = true;
 
 	LW_DBG(INFO, "");
 
+	trace_logiwin_isr(lw->video_dev.minor, isr, lw->frame_seq, ts);
+
 	logiwin_int_stat_clear(&lw->lw_par, isr);
 
-	if (isr & LOGIWIN_INT_RESOLUTION)
-		lw->flags |= (LOGIWIN_FLAG_UPDATE_REGISTERS |
-			      LOGIWIN_FLAG_RESOLUTION_CHANGE);
+	if (isr & LOGIWIN_INT_RESOLUTION) {
+		set_bit(LOGIWIN_FLAG_RESOLUTION_CHANGE, &lw->flags);
+		set_bit(LOGIWIN_FLAG_UPDATE_REGISTERS, &lw->flags);
+		lw->stats.resolution_changes++;
+	}
 
-	if (!(lw->flags & LOGIWIN_FLAG_HW_BUFFER_SWITCH) &&
+	if (!test_bit(LOGIWIN_FLAG_HW_BUFFER_SWITCH, &lw->flags) &&
 	    (isr & LOGIWIN_INT_FRAME_START)) {
-		if (lw->stream_state == CAPTURE_STREAM_ON) {
-			address = lw->capture.address;
-			id = logiwin_get_buf(lw);
-			if (logiwin_handle_buffer(lw)) {
-				next_buff = false;
+		memset(&ev, 0, sizeof(ev));
+		ev.type = V4L2_EVENT_FRAME_SYNC;
+		ev.u.frame_sync.frame_sequence = lw->frame_seq;
+		v4l2_event_queue(&lw->video_dev, &ev);
+
+		/* staged settings apply from the frame starting now */
+		spin_lock(&lw->irq_lock);
+		if (lw->commit_pending)
+			logiwin_commit(lw);
+		spin_unlock(&lw->irq_lock);
+
+		/*
+		 * Frame start of the first frame only confirms that the
+		 * buffer programmed in logiwin_enable is being written.
+		 * Afterwards, the active buffer holds a complete frame and
+		 * is returned only when there is a queued buffer to take
+		 * its place, otherwise it gets overwritten by the next frame.
+		 */
+		if (lw->stream_state == CAPTURE_STREAM_ON &&
+		    test_bit(LOGIWIN_FLAG_CPU_BUFFER_SWITCH, &lw->flags)) {
+			logiwin_cpu_buffer_switch(lw, ts);
+		} else if (lw->stream_state == CAPTURE_STREAM_ON &&
+			   lw->frame_seq > 0 && lw->armed) {
+			/*
+			 * Buffer address written late, or when frame store
+			 * was resumed, is taken from the frame start it was
+			 * tagged with. Until then the active buffer is
+			 * written over. logiWIN latches the address at frame
+			 * start, so the frame written last is complete and
+			 * the active buffer is returned with it.
+			 */
+			if (lw->frame_seq == lw->armed_seq) {
+				frame = lw->armed;
+				lw->armed = NULL;
+				logiwin_handle_buffer(lw, frame,
+						      VB2_BUF_STATE_DONE);
+			} else {
 				lw->frames_skip++;
+				lw->stats.frames_skipped++;
 			}
-		} else if (lw->stream_state == OVERLAY_STREAM_ON) {
-			if (lw->flags & LOGIWIN_FLAG_OVERLAY_BUFFER_SWITCH) {
-				address = lw->overlay.address;
-				id = logiwin_get_buf(lw);
-			} else {
-				next_buff = false;
+		} else if (lw->stream_state == CAPTURE_STREAM_ON &&
+			   lw->frame_seq > 0) {
+			frame = logiwin_get_buf(lw);
+			if (frame) {
+				trace_logiwin_get_buf(lw->video_dev.minor,
+						      frame->vb.v4l2_buf.index,
+						      lw->frame_seq, ts);
+				logiwin_apply_buffer_config(lw, frame);
+				pa = vb2_dma_contig_plane_dma_addr(&frame->vb,
+								   0);
+				logiwin_set_buffer(lw, pa);
+				/*
+				 * Frame store was stopped. logiWIN is disabled
+				 * while it resumes, this frame is skipped and
+				 * the buffer is taken at the next frame start.
+				 */
+				if (!lw->active)
+					logiwin_store_stop(lw, false);
+				logiwin_hist_add(lw->stats.irq_latency,
+						 ktime_get_ns() - ts);
+			} else if (lw->active) {
+				/*
+				 * No buffer to take over, stop storing frames
+				 * instead of writing over the completed one.
+				 */
+				logiwin_store_stop(lw, true);
+			}
+			/*
+			 * Next frame already started, the address or frame
+			 * store stop was written too late and the completed
+			 * buffer was written over. Lateness within a frame
+			 * is not seen here. After a late address logiWIN
+			 * writes the active buffer for the frame already
+			 * started, its interrupt is pending and the new buffer
+			 * is taken at the frame start after it.
+			 */
+			isr = logiwin_int_stat_get(&lw->lw_par);
+			if (!frame || !lw->active) {
+				lw->frames_skip++;
+				lw->stats.frames_skipped++;
+			}
+			if (frame && (!lw->active ||
+				      (isr & LOGIWIN_INT_FRAME_START))) {
+				/* the completed frame was written over */
+				if (isr & LOGIWIN_INT_FRAME_START)
+					lw->stats.frames_late++;
+				lw->armed = frame;
+				lw->armed_seq = lw->frame_seq +
+					((isr & LOGIWIN_INT_FRAME_START) ?
+					 2 : 1);
+			} else if (frame || lw->active)
+				logiwin_handle_buffer(lw, frame,
+					(isr & LOGIWIN_INT_FRAME_START) ?
+					VB2_BUF_STATE_ERROR :
+					VB2_BUF_STATE_DONE);
+		} else if (lw->stream_state == OVERLAY_STREAM_ON &&
+			   test_bit(LOGIWIN_FLAG_OVERLAY_BUFFER_SWITCH,
+				    &lw->flags)) {
+			id = logiwin_get_overlay_buf(lw);
+			pa = lw->overlay.address[id].pa;
+			if (pa) {
+				logiwin_set_buffer(lw, pa);
+				lw->stats.overlay_switches++;
 			}
 		}
-		lw->frame_seq++;
-
-		if (next_buff && lw->frames > 1) {
-			if (address[id].pa)
-				logiwin_set_memory_offset(&lw->lw_par,
-							  address[id].pa,
-							  address[id].pa);
+		if (lw->frame_seq > 0) {
+			logiwin_hist_add(lw->stats.frame_interval,
+					 ts - lw->frame_ts);
+			if (lw->pix_format.field == V4L2_FIELD_ALTERNATE)
+				logiwin_field_interval(lw, ts - lw->frame_ts);
 		}
+		/* start of the frame written to the active buffer */
+		lw->frame_ts = ts;
+		lw->frame_seq++;
 
 		if (lw->stream_state == OVERLAY_STREAM_ON)
 			wake_up_interruptible(&lw->wait_buff_switch);
+
+		if (lw->anim_active)
+			set_bit(LOGIWIN_FLAG_ANIM_STEP, &lw->flags);
 	}
 
-	tasklet_schedule(&lw->tasklet);
+	if (test_bit(LOGIWIN_FLAG_UPDATE_REGISTERS, &lw->flags) ||
+	    test_bit(LOGIWIN_FLAG_ANIM_STEP, &lw->flags) ||
+	    test_bit(LOGIWIN_FLAG_CTRL_RESTART, &lw->flags))
+		return IRQ_WAKE_THREAD;
 
 	return IRQ_HANDLED;
 }
 
+static int logiwin_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct logiwin *lw = ctrl->priv;
+
+	switch (ctrl->id) {
+	case LOGIWIN_CID_FRAMES_CAPTURED:
+		ctrl->val64 = lw->stats.frames_captured;
+		break;
+	case LOGIWIN_CID_FRAMES_SKIPPED:
+		ctrl->val64 = lw->stats.frames_skipped;
+		break;
+	case LOGIWIN_CID_RESOLUTION_CHANGES:
+		ctrl->val64 = lw->stats.resolution_changes;
+		break;
+	case LOGIWIN_CID_OVERLAY_SWITCHES:
+		ctrl->val64 = lw->stats.overlay_switches;
+		break;
+	case LOGIWIN_CID_FRAMES_LATE:
+		ctrl->val64 = lw->stats.frames_late;
+		break;
+	case LOGIWIN_CID_IRQ_LATENCY:
+		memcpy(ctrl->p_new.p_u32, lw->stats.irq_latency,
+		       sizeof(lw->stats.irq_latency));
+		break;
+	case LOGIWIN_CID_DQBUF_LATENCY:
+		memcpy(ctrl->p_new.p_u32, lw->stats.dqbuf_latency,
+		       sizeof(lw->stats.dqbuf_latency));
+		break;
+	case LOGIWIN_CID_FRAME_INTERVAL:
+		memcpy(ctrl->p_new.p_u32, lw->stats.frame_interval,
+		       sizeof(lw->stats.frame_interval));
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static const struct v4l2_ctrl_ops logiwin_ctrl_ops = {
+	.g_volatile_ctrl = logiwin_g_volatile_ctrl,
+};
+
+#define LOGIWIN_STATS_CTRL(_id, _name)				\
+	{							\
+		.ops = &logiwin_ctrl_ops,			\
+		.id = _id,					\
+		.name = _name,					\
+		.type = V4L2_CTRL_TYPE_INTEGER64,		\
+		.max = 0xffffffff,				\
+		.step = 1,					\
+		.flags = V4L2_CTRL_FLAG_READ_ONLY |		\
+			 V4L2_CTRL_FLAG_VOLATILE,		\
+	}
+
+/* log2 nanosecond histogram, bucket i counts values from 2^i ns */
+#define LOGIWIN_HIST_CTRL(_id, _name)				\
+	{							\
+		.ops = &logiwin_ctrl_ops,			\
+		.id = _id,					\
+		.name = _name,					\
+		.type = V4L2_CTRL_TYPE_U32,			\
+		.max = 0xffffffff,				\
+		.step = 1,					\
+		.dims = { LOGIWIN_HIST_BUCKETS },		\
+		.flags = V4L2_CTRL_FLAG_READ_ONLY |		\
+			 V4L2_CTRL_FLAG_VOLATILE,		\
+	}
+
+static const struct v4l2_ctrl_config logiwin_stats_ctrls[] = {
+	LOGIWIN_STATS_CTRL(LOGIWIN_CID_FRAMES_CAPTURED, "Frames Captured"),
+	LOGIWIN_STATS_CTRL(LOGIWIN_CID_FRAMES_SKIPPED, "Frames Skipped"),
+	LOGIWIN_STATS_CTRL(LOGIWIN_CID_RESOLUTION_CHANGES,
+			   "Resolution Changes"),
+	LOGIWIN_STATS_CTRL(LOGIWIN_CID_OVERLAY_SWITCHES, "Overlay Switches"),
+	LOGIWIN_STATS_CTRL(LOGIWIN_CID_FRAMES_LATE, "Frames Late"),
+	LOGIWIN_HIST_CTRL(LOGIWIN_CID_IRQ_LATENCY, "IRQ Latency Histogram"),
+	LOGIWIN_HIST_CTRL(LOGIWIN_CID_DQBUF_LATENCY, "DQBUF Latency Histogram"),
+	LOGIWIN_HIST_CTRL(LOGIWIN_CID_FRAME_INTERVAL,
+			  "Frame Interval Histogram"),
+};
+
+static int logiwin_init_ctrls(struct logiwin *lw)
+{
+	int i;
+
+	v4l2_ctrl_handler_init(&lw->ctrl_handler,
+			       ARRAY_SIZE(logiwin_stats_ctrls));
+
+	for (i = 0; i < ARRAY_SIZE(logiwin_stats_ctrls); i++)
+		v4l2_ctrl_new_custom(&lw->ctrl_handler,
+				     &logiwin_stats_ctrls[i], lw);
+
+	if (lw->ctrl_handler.error) {
+		v4l2_ctrl_handler_free(&lw->ctrl_handler);
+		return lw->ctrl_handler.error;
+	}
+
+	lw->video_dev.ctrl_handler = &lw->ctrl_handler;
+
+	return 0;
+}
+
+static void logiwin_hist_show(struct seq_file *s, const char *name, u32 *hist)
+{
+	int i;
+
+	seq_printf(s, "%s:\n", name);
+	for (i = 0; i < LOGIWIN_HIST_BUCKETS; i++)
+		if (hist[i])
+			seq_printf(s, "%12llu ns: %u\n", 1ULL << i, hist[i]);
+}
+
+static int logiwin_histograms_show(struct seq_file *s, void *unused)
+{
+	struct logiwin *lw = s->private;
+
+	logiwin_hist_show(s, "irq to address programming",
+			  lw->stats.irq_latency);
+	logiwin_hist_show(s, "frame start to dqbuf", lw->stats.dqbuf_latency);
+	logiwin_hist_show(s, "frame interval", lw->stats.frame_interval);
+
+	return 0;
+}
+
+static int logiwin_histograms_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, logiwin_histograms_show, inode->i_private);
+}
+
+static const struct file_operations logiwin_histograms_fops = {
+	.owner = THIS_MODULE,
+	.open = logiwin_histograms_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void logiwin_init_debugfs(struct logiwin *lw)
+{
+	struct logiwin_stats *stats = &lw->stats;
+
+	lw->debugfs = debugfs_create_dir(dev_name(lw->dev), NULL);
+	if (IS_ERR_OR_NULL(lw->debugfs)) {
+		lw->debugfs = NULL;
+		return;
+	}
+
+	debugfs_create_u32("frames_captured", S_IRUGO, lw->debugfs,
+			   &stats->frames_captured);
+	debugfs_create_u32("frames_skipped", S_IRUGO, lw->debugfs,
+			   &stats->frames_skipped);
+	debugfs_create_u32("resolution_changes", S_IRUGO, lw->debugfs,
+			   &stats->resolution_changes);
+	debugfs_create_u32("overlay_switches", S_IRUGO, lw->debugfs,
+			   &stats->overlay_switches);
+	debugfs_create_u32("frames_late", S_IRUGO, lw->debugfs,
+			   &stats->frames_late);
+	debugfs_create_file("histograms", S_IRUGO, lw->debugfs, lw,
+			    &logiwin_histograms_fops);
+}
+
 static int logiwin_get_config(struct platform_device *pdev,
 			      struct logiwin_config *lw_cfg)
 {
@@ -1727,6 +3342,8 @@ static int logiwin_get_config(struct platform_device *pdev,
 
 	if (of_property_read_bool(dn, "hw-buffer-switch"))
 		lw_cfg->hw_buff_switch = true;
+	if (of_property_read_bool(dn, "cpu-buffer-switch"))
+		lw_cfg->cpu_buff_switch = true;
 
 	return 0;
 
@@ -1780,8 +3397,10 @@ static int logiwin_probe(struct platform_device *pdev)
 		ret = lw_hw->irq;
 		goto error_handle;
 	} else {
-		ret = devm_request_irq(dev, lw_hw->irq, logiwin_isr,
-				       IRQF_TRIGGER_HIGH, DRIVER_NAME, lw);
+		ret = devm_request_threaded_irq(dev, lw_hw->irq, logiwin_isr,
+						logiwin_irq_thread,
+						IRQF_TRIGGER_HIGH, DRIVER_NAME,
+						lw);
 		if (ret) {
 			dev_err(dev, "failed request irq\n");
 			goto error_handle;
@@ -1802,27 +3421,101 @@ static int logiwin_probe(struct platform_device *pdev)
 	}
 
 	if (lw_cfg->vmem_addr_start) {
+		/*
+		 * Reserved video memory is outside the kernel linear mapping
+		 * cached buffers are allocated from and maintained in.
+		 */
+		if (cache_mode == LOGIWIN_CACHE_CACHED) {
+			dev_err(dev, "invalid cache mode with vmem\n");
+			ret = -EINVAL;
+			goto error_handle;
+		}
+		/*
+		 * Reserved video memory backs the device coherent pool, so
+		 * videobuf2 buffers are carved from it instead of from CMA.
+		 */
 		lw_hw->vmem_pbase = lw_cfg->vmem_addr_start;
-		lw_hw->vmem_size = lw_cfg->output_hres * lw_cfg->output_vres *
-				   (lw_hw->bpp / 8);
-		if ((lw_cfg->vmem_addr_end - lw_cfg->vmem_addr_start) <
-		    lw_hw->vmem_size) {
+		lw_hw->vmem_size = lw_cfg->vmem_addr_end -
+				   lw_cfg->vmem_addr_start;
+		if (lw_hw->vmem_size < (lw_cfg->output_hres *
+		    lw_cfg->output_vres * (lw_hw->bpp / 8))) {
 			dev_err(dev, "invalid vmem size\n");
+			ret = -EINVAL;
+			goto error_handle;
 		}
-#ifdef LOGIWIN_MMAP_VMEM
-		else {
-			lw_hw->vmem_base = devm_ioremap(dev, lw_hw->vmem_pbase,
-							lw_hw->vmem_size);
-		}
-		if (!lw_hw->vmem_base) {
-			dev_err(dev, "failed vmem ioremap\n");
+		if (!dma_declare_coherent_memory(dev, lw_hw->vmem_pbase,
+						 lw_hw->vmem_pbase,
+						 lw_hw->vmem_size,
+						 DMA_MEMORY_MAP |
+						 DMA_MEMORY_EXCLUSIVE)) {
+			dev_err(dev, "failed declare vmem\n");
+			lw_hw->vmem_pbase = 0;
 			ret = -ENOMEM;
 			goto error_handle;
 		}
-#endif
+	}
+
+	spin_lock_init(&lw->irq_lock);
+
+	mutex_init(&lw->fops_lock);
+	mutex_init(&lw->ioctl_lock);
+	mutex_init(&lw->queue_lock);
+
+	init_waitqueue_head(&lw->wait_buff_switch);
+	init_waitqueue_head(&lw->wait_resolution);
+
+	atomic_set(&lw->wait_buff_switch_refcnt, 0);
+	atomic_set(&lw->wait_resolution_refcnt, 0);
+
+	lw->cache_mode = cache_mode;
+	if (lw->cache_mode == LOGIWIN_CACHE_WRITE_COMBINE) {
+		lw->alloc_ctx = vb2_dma_contig_init_ctx(dev);
+		if (IS_ERR(lw->alloc_ctx)) {
+			dev_err(dev, "failed init dma contig context\n");
+			ret = PTR_ERR(lw->alloc_ctx);
+			lw->alloc_ctx = NULL;
+			goto error_handle;
+		}
+		lw->queue.io_modes = VB2_MMAP | VB2_DMABUF;
+		lw->queue.mem_ops = &vb2_dma_contig_memops;
+	} else if (lw->cache_mode == LOGIWIN_CACHE_CACHED) {
+		if (!IS_ENABLED(CONFIG_XYLON_LOGIWIN_CACHED)) {
+			dev_err(dev, "cached mode not configured\n");
+			ret = -EINVAL;
+			goto error_handle;
+		}
+		lw->alloc_ctx = lw;
+		lw->queue.io_modes = VB2_MMAP;
+		lw->queue.mem_ops = &logiwin_memops;
+	} else {
+		dev_err(dev, "invalid cache mode %u\n", cache_mode);
+		ret = -EINVAL;
+		goto error_handle;
+	}
+
+	lw->queue.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	lw->queue.drv_priv = lw;
+	lw->queue.buf_struct_size = sizeof(struct logiwin_frame);
+	lw->queue.ops = &logiwin_vb2_ops;
+	lw->queue.timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC |
+				    V4L2_BUF_FLAG_TSTAMP_SRC_SOE;
+	lw->queue.min_buffers_needed = 1;
+	lw->queue.lock = &lw->queue_lock;
+
+	ret = vb2_queue_init(&lw->queue);
+	if (ret) {
+		dev_err(dev, "failed init vb2 queue\n");
+		goto error_handle;
 	}
 
 	lw->video_dev = logiwin_template;
+	lw->video_dev.queue = &lw->queue;
+
+	ret = logiwin_init_ctrls(lw);
+	if (ret) {
+		dev_err(dev, "failed init controls\n");
+		goto error_handle;
+	}
 
 	strlcpy(lw->v4l2_dev.name, DRIVER_NAME, sizeof(lw->v4l2_dev.name));
 
@@ -1842,29 +3535,26 @@ static int logiwin_probe(struct platform_device *pdev)
 		dev_info(dev, "video device registered\n");
 	}
 
-	spin_lock_init(&lw->irq_lock);
-
-	mutex_init(&lw->fops_lock);
-	mutex_init(&lw->ioctl_lock);
-
-	tasklet_init(&lw->tasklet, logiwin_tasklet, (unsigned long)lw);
-
-	init_waitqueue_head(&lw->wait_buff_switch);
-	init_waitqueue_head(&lw->wait_frame);
-	init_waitqueue_head(&lw->wait_resolution);
-
-	atomic_set(&lw->wait_buff_switch_refcnt, 0);
-	atomic_set(&lw->wait_resolution_refcnt, 0);
-
 	video_set_drvdata(&lw->video_dev, lw);
 
 	platform_set_drvdata(pdev, lw);
 
+	logiwin_init_debugfs(lw);
+
 	return 0;
 
 error_handle:
 	video_unregister_device(&lw->video_dev);
 
+	if (lw)
+		v4l2_ctrl_handler_free(&lw->ctrl_handler);
+
+	if (lw && lw->alloc_ctx &&
+	    lw->cache_mode == LOGIWIN_CACHE_WRITE_COMBINE)
+		vb2_dma_contig_cleanup_ctx(lw->alloc_ctx);
+	if (lw && lw->lw_hw.vmem_pbase)
+		dma_release_declared_memory(dev);
+
 	return ret;
 }
 
@@ -1874,10 +3564,15 @@ static int __exit logiwin_remove(struct platform_device *pdev)
 
 	LW_DBG(INFO, "");
 
-	tasklet_disable(&lw->tasklet);
-	tasklet_kill(&lw->tasklet);
+	debugfs_remove_recursive(lw->debugfs);
 
 	video_unregister_device(&lw->video_dev);
+	v4l2_ctrl_handler_free(&lw->ctrl_handler);
+
+	if (lw->cache_mode == LOGIWIN_CACHE_WRITE_COMBINE)
+		vb2_dma_contig_cleanup_ctx(lw->alloc_ctx);
+	if (lw->lw_hw.vmem_pbase)
+		dma_release_declared_memory(lw->dev);
 
 	return 0;
 }
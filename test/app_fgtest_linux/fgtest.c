@@ -368,8 +368,8 @@ static int videodevice_init(struct video_device *vd)
 		}
 		printf("V4L2 FB%d:\n%u bytes at device memory offset %u,",
 			i, vd->buf.length, vd->buf.m.offset);
-		vd->mem[i] = mmap(0, vd->buf.length, PROT_WRITE, MAP_SHARED,
-			vd->fgfd, vd->buf.m.offset);
+		vd->mem[i] = mmap(0, vd->buf.length, (PROT_READ | PROT_WRITE),
+			MAP_SHARED, vd->fgfd, vd->buf.m.offset);
 		if (vd->mem[i] == MAP_FAILED)
 		{
 			perror("Unable to map buffer");